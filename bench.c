@@ -0,0 +1,366 @@
+/* ----- NebulaFM benchmark ----- */
+/* See LICENSE for license details. */
+
+/* Runs nebulafm on a pseudo-terminal over synthetic directories and measures
+ * the time to the first frame, the time to load the whole listing, the latency
+ * of the keypresses, the peak memory and the bytes sent to the terminal. */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <pty.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define QUIET_MS 20 // A frame has been drawn when the terminal is quiet this long
+#define SETTLE_MS 1000 // A listing has been loaded when no more batches come for this long
+#define TIMEOUT_MS 600000 // A session that does not start is given up
+#define ANSWER_MS 2000 // A key that changes nothing on the screen is given up
+#define KEYS_NUM 200 // The keypresses measured for each scenario
+#define TERM_ROWS 40
+#define TERM_COLS 120
+#define STATUS_MARK "]  [*" // Printed with the status bar, the first frame is complete after it
+
+typedef struct session
+{
+    pid_t pid;
+    int fd; // The master side of the pseudo-terminal
+    size_t bytes; // Written by nebulafm to the terminal
+}
+session;
+
+typedef struct scenario
+{
+    const char *name;
+    const char *setup; // Sent before the measured keys, not measured
+    const char *prefix; // Sent before each measured key, not measured
+    const char *keys; // Measured, repeated until num keys are sent
+    const char *teardown;
+    int num;
+    int quiet; // How long the terminal is quiet after the answer to a key (ms)
+}
+scenario;
+
+/* The hot paths: drawing, the clipboard lookups, the search and the reading and sorting of the listing */
+const scenario scenarios[] = {
+    { "move", "", "", "jk", "", KEYS_NUM, QUIET_MS },
+    { "page", "", "", "JK", "", KEYS_NUM, QUIET_MS },
+    { "select", "", "", " ", "Rgg", KEYS_NUM, QUIET_MS },
+    { "search", "/", "", "1234\x7f\x7f\x7f\x7f", "\n", KEYS_NUM, QUIET_MS },
+    { "search_next", "/12\n", "", "nN", "gg", KEYS_NUM, QUIET_MS },
+    { "resort", "", "o", "na", "", 10, SETTLE_MS },
+};
+
+double now_ms(void);
+void make_tree(const char *, long);
+void start_session(session *, const char *, const char *, const char *);
+double wait_frame(session *, double, int, int, const char *);
+double press_key(session *, char, int);
+long stop_session(session *);
+int compare_doubles(const void *, const void *);
+double get_percentile(double *, int, int);
+void remove_snapshots(const char *);
+
+int main(int argc, char *argv[])
+{
+    const char *bin = "./nebulafm";
+    const char *root = "/tmp/nebulafm-bench";
+    const char *out_path = "bench.json";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:d:o:")) != -1)
+    {
+        if (opt == 'b')
+            bin = optarg;
+        else if (opt == 'd')
+            root = optarg;
+        else if (opt == 'o')
+            out_path = optarg;
+        else
+        {
+            fprintf(stderr, "usage: %s [-b binary] [-d directory] [-o output] entries...\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (optind == argc)
+    {
+        fprintf(stderr, "usage: %s [-b binary] [-d directory] [-o output] entries...\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    /* nebulafm opens only absolute paths */
+    char root_path[PATH_MAX];
+    char bin_path[PATH_MAX];
+    mkdir(root, 0755);
+    if (realpath(root, root_path) == NULL || realpath(bin, bin_path) == NULL)
+    {
+        perror("path error\n");
+        exit(EXIT_FAILURE);
+    }
+    char conf_path[PATH_MAX + 8];
+    snprintf(conf_path, sizeof(conf_path), "%s/conf", root_path);
+    mkdir(conf_path, 0755);
+
+    FILE *out = fopen(out_path, "w");
+    if (out == NULL)
+    {
+        perror("output error\n");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(out, "{\n  \"binary\": \"%s\",\n  \"time\": %ld,\n  \"rows\": %d,\n  \"columns\": %d,\n  \"runs\": [",
+            bin_path, (long) time(NULL), TERM_ROWS, TERM_COLS);
+
+    for (int arg = optind; arg < argc; arg++)
+    {
+        long num = atol(argv[arg]);
+        char dir[PATH_MAX + 32];
+        snprintf(dir, sizeof(dir), "%s/%ld", root_path, num);
+        make_tree(dir, num);
+
+        /* Cold: the listing is read and sorted, then the keys are measured */
+        session s;
+        remove_snapshots(conf_path);
+        double start = now_ms();
+        start_session(&s, bin_path, dir, conf_path);
+        double first_frame = wait_frame(&s, start, QUIET_MS, TIMEOUT_MS, STATUS_MARK);
+        double loaded = wait_frame(&s, start, SETTLE_MS, 0, NULL);
+        if (loaded < first_frame)
+            loaded = first_frame; // Shown whole in the first frame
+
+        printf("%ld entries: first frame %.1f ms, loaded %.1f ms\n", num, first_frame, loaded);
+        fprintf(out, "%s\n    {\n      \"entries\": %ld,\n      \"first_frame_ms\": %.3f,\n      \"load_ms\": %.3f,\n"
+                "      \"keys\": {", (arg == optind) ? "" : ",", num, first_frame, loaded);
+        double *samples = malloc(KEYS_NUM * sizeof(double));
+        if (samples == NULL)
+        {
+            perror("memory allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+        {
+            const scenario *sc = &scenarios[i];
+            int samples_num = 0;
+            for (const char *key = sc->setup; *key != '\0'; key++)
+                press_key(&s, *key, QUIET_MS);
+            for (int k = 0; k < sc->num; k++)
+            {
+                for (const char *key = sc->prefix; *key != '\0'; key++)
+                    press_key(&s, *key, QUIET_MS);
+                double latency = press_key(&s, sc->keys[k % strlen(sc->keys)], sc->quiet);
+                if (latency >= 0)
+                    samples[samples_num++] = latency; // A key that changes nothing on the screen is not counted
+            }
+            for (const char *key = sc->teardown; *key != '\0'; key++)
+                press_key(&s, *key, QUIET_MS);
+
+            qsort(samples, samples_num, sizeof(double), compare_doubles);
+            double p50 = get_percentile(samples, samples_num, 50);
+            double p99 = get_percentile(samples, samples_num, 99);
+            double max = (samples_num != 0) ? samples[samples_num - 1] : 0;
+            printf("  %-12s p50 %8.3f ms  p99 %8.3f ms  max %8.3f ms  (%d keys)\n", sc->name, p50, p99, max,
+                   samples_num);
+            fprintf(out, "%s\n        \"%s\": { \"keys\": %d, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f }",
+                    (i == 0) ? "" : ",", sc->name, samples_num, p50, p99, max);
+        }
+        free(samples);
+        size_t bytes = s.bytes;
+        long rss = stop_session(&s);
+
+        /* Warm: the listing may come from the snapshot saved by the cold session */
+        start = now_ms();
+        start_session(&s, bin_path, dir, conf_path);
+        double warm_frame = wait_frame(&s, start, QUIET_MS, TIMEOUT_MS, STATUS_MARK);
+        wait_frame(&s, start, SETTLE_MS, 0, NULL);
+        stop_session(&s);
+
+        printf("  warm first frame %.1f ms, peak RSS %ld kB, %zu bytes to the terminal\n", warm_frame, rss, bytes);
+        fprintf(out, "\n      },\n      \"warm_first_frame_ms\": %.3f,\n      \"peak_rss_kb\": %ld,\n"
+                "      \"terminal_bytes\": %zu\n    }", warm_frame, rss, bytes);
+        fflush(out);
+    }
+    fprintf(out, "\n  ]\n}\n");
+    fclose(out);
+    printf("Results written to %s\n", out_path);
+    return 0;
+}
+
+double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+void make_tree(const char *dir, long num)
+{
+    /* A tree is made once and kept for the next runs */
+    char done_path[PATH_MAX + 40];
+    snprintf(done_path, sizeof(done_path), "%s.done", dir);
+    if (access(done_path, F_OK) == 0)
+        return;
+    printf("Making %ld entries in %s\n", num, dir);
+    fflush(stdout);
+    mkdir(dir, 0755);
+    int dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dirfd == -1)
+    {
+        perror("tree error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Short and long names in a scrambled order, one in a hundred a directory */
+    char name[256];
+    for (long i = 0; i < num; i++)
+    {
+        long id = (i * 2654435761UL) % (num * 4 + 1);
+        if (i % 2 == 0)
+            snprintf(name, sizeof(name), "%07ld", id);
+        else
+            snprintf(name, sizeof(name), "%07ld_%.*s.txt", id, (int) (i % 97) + 8,
+                     "a_rather_long_name_of_a_file_that_makes_the_sort_keys_and_the_lines_of_the_panes_longer_"
+                     "than_the_short_ones");
+        if (i % 100 == 0)
+        {
+            if (mkdirat(dirfd, name, 0755) == -1 && errno != EEXIST)
+            {
+                perror("tree error\n");
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+        int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1)
+        {
+            perror("tree error\n");
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+    close(dirfd);
+    int fd = open(done_path, O_WRONLY | O_CREAT, 0644);
+    if (fd != -1)
+        close(fd);
+}
+
+void start_session(session *s, const char *bin, const char *dir, const char *conf)
+{
+    struct winsize ws = { .ws_row = TERM_ROWS, .ws_col = TERM_COLS };
+    s->bytes = 0;
+    s->pid = forkpty(&s->fd, NULL, NULL, &ws);
+    if (s->pid == -1)
+    {
+        perror("pty error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (s->pid == 0)
+    {
+        /* The same settings for every run, the snapshots and the clipboard of the user are not touched */
+        setenv("TERM", "xterm-256color", 1);
+        setenv("XDG_CONFIG_HOME", conf, 1);
+        execl(bin, bin, dir, (char *) NULL);
+        _exit(127);
+    }
+}
+
+double wait_frame(session *s, double start, int quiet, int timeout, const char *mark)
+{
+    /* The time of the last byte before the terminal has been quiet, -1 if nothing came in time */
+    char buf[65536 + 16];
+    size_t mark_len = (mark != NULL) ? strlen(mark) : 0;
+    size_t kept = 0; // The end of the last read, the mark may be split between two reads
+    double last = -1;
+    double deadline = now_ms() + timeout;
+    struct pollfd fds = { s->fd, POLLIN, 0 };
+    for (;;)
+    {
+        int ret = poll(&fds, 1, quiet);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+        {
+            if ((last >= 0 && mark == NULL) || now_ms() > deadline)
+                break;
+            continue; // Still waiting for the answer
+        }
+        ssize_t len = read(s->fd, buf + kept, 65536);
+        if (len <= 0)
+            break; // nebulafm has exited
+        s->bytes += len;
+        last = now_ms();
+        if (mark != NULL && memmem(buf, kept + len, mark, mark_len) != NULL)
+            mark = NULL; // Then only the end of the frame is waited for
+        else if (mark != NULL)
+        {
+            size_t total = kept + len;
+            kept = (total < mark_len - 1) ? total : mark_len - 1;
+            memmove(buf, buf + total - kept, kept);
+        }
+    }
+    return (last >= 0) ? last - start : -1;
+}
+
+double press_key(session *s, char key, int quiet)
+{
+    double start = now_ms();
+    if (write(s->fd, &key, 1) != 1)
+    {
+        perror("pty error\n");
+        exit(EXIT_FAILURE);
+    }
+    return wait_frame(s, start, quiet, ANSWER_MS, NULL);
+}
+
+long stop_session(session *s)
+{
+    /* The peak memory is known when nebulafm has exited */
+    struct rusage usage;
+    int status;
+    char key = 'q';
+    if (write(s->fd, &key, 1) != 1)
+        kill(s->pid, SIGTERM);
+    char buf[65536];
+    while (read(s->fd, buf, sizeof(buf)) > 0)
+        ; // Until the terminal is closed
+    close(s->fd);
+    if (wait4(s->pid, &status, 0, &usage) == -1)
+        return -1;
+    return usage.ru_maxrss;
+}
+
+int compare_doubles(const void *arg1, const void *arg2)
+{
+    double a = *(const double *) arg1;
+    double b = *(const double *) arg2;
+    return (a > b) - (a < b);
+}
+
+double get_percentile(double *samples, int num, int percent)
+{
+    if (num == 0)
+        return 0;
+    return samples[(num - 1) * percent / 100];
+}
+
+void remove_snapshots(const char *conf)
+{
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/nebulafm/snapshots", conf);
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return;
+    struct dirent *pDirent;
+    while ((pDirent = readdir(dir)) != NULL)
+        if (pDirent->d_name[0] != '.')
+            unlinkat(dirfd(dir), pDirent->d_name, 0);
+    closedir(dir);
+}
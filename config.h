@@ -1,8 +1,31 @@
 #ifndef CONFIG
 #define CONFIG
 
-#define REFRESH 50 // Refresh every 5 seconds
+#define REFRESH 50 // Check every 5 seconds the directories that inotify cannot watch
 #define HIDDENVIEW 1 // Display (1) or hide (0) hidden files
+#define SORTMODE 0 // Sort by name (0), with the numbers in names in numeric order (1), by size (2), by time (3) or by extension (4)
+#define DIRSFIRST 1 // List the directories before the other files (1) or among them (0)
+#define SORT_LOCALE 0 // Sort by name with the collation of the locale (1) or by the case-folded bytes (0)
+#define DETAILS 0 // Show the size, time, permissions and owner of the files (1) or only the names (0)
+#define MIME_COLORS 0 // Color the files by their type (1), found in the background, or not (0)
+#define PREVIEW_SIZE 65536 // The head of a file shown in the preview (bytes)
+#define PREVIEW_CACHE 16 // The number of previews kept in memory
+#define FINDER_THREADS 8 // The number of threads walking the directories for the finder
+#define REFRESH_FINDER 50 // Show the new files of the finder every 50 milliseconds
+#define USAGE_THREADS 8 // The number of threads finding the disk usage of the directories
+#define USAGE_REFRESH 5 // Sort the files again by the growing totals every 0.5 seconds
+#define META_CACHE 4096 // The number of files whose details are kept in memory
+#define META_THREADS 4 // The number of threads reading the details of the files
+#define STAT_BATCH 256 // The number of files whose metadata is read by one system call
+#define SNAPSHOTS 1 // Save the listings of large directories to show them at once the next time (1) or not (0)
+#define SNAPSHOT_MIN 10000 // The fewest files of a directory that get a snapshot
+#define SNAPSHOT_FILES 16 // The number of snapshots kept
+#define READDIR_BUF 262144 // The buffer size for reading directories (bytes)
+#define COPY_BUF 1048576 // The buffer size for copying files without copy_file_range (bytes)
+#define COPY_DIRBUF 32768 // The buffer size for reading copied directories (bytes)
+#define COPY_THREADS 8 // The number of threads copying files
+#define ROTATIONAL_THREADS 1 // Threads using the same hard disk at the same time
+#define JOB_REFRESH 5 // Update the progress of the background jobs every 0.5 seconds
 
 /* Key definitions */
 #define KEY_BACKWARD 'h' // Go to the parent directory
@@ -28,11 +51,27 @@
 #define KEY_SELEMPTY 'R' // Clear clipboard
 #define KEY_MAKEDIR 'm' // Create a new directory
 #define KEY_MAKEFILE 'f' // Create a new file
-#define KEY_VIEW 'i' // Preview file or directory
+#define KEY_VIEW 'i' // Show or hide the preview of the selected file in the other pane
 #define KEY_ADDBKMR 'b' // Add a new bookmark
 #define KEY_OPENBKMR '\'' // Open bookmark list
 #define KEY_DELBKMR 'Z' // Delete the bookmark
 #define KEY_SEARCH '/' // Search in the current directory
 #define KEY_SEARCHNEXT 'n' // The next match in the file list
+#define KEY_SEARCHPREV 'N' // The previous match in the file list
+#define KEY_FUZZY 'F' // Find files under the current directory by fuzzy matching
+#define KEY_SORT 'o' // Change the order of the files
+#define KEY_SORT_ALPHA 'a' // Sort by name
+#define KEY_SORT_NATURAL 'n' // Sort by name, file9 before file10
+#define KEY_SORT_SIZE 's' // Sort by size, the largest first
+#define KEY_SORT_TIME 't' // Sort by modification time, the newest first
+#define KEY_SORT_EXT 'e' // Sort by extension
+#define KEY_SORT_DIRS 'd' // List the directories first or among the files
+#define KEY_USAGE 'u' // Sort the files by the disk usage of their subtrees or not
+#define KEY_DETAILS 'x' // Show or hide the details of the files
+#define KEY_COLORS 'C' // Color the files by their type or not
+#define KEY_JOBS 'w' // List the background jobs
+#define KEY_JOBPAUSE 'p' // Pause or resume the chosen job
+#define KEY_JOBCANCEL 'c' // Cancel the chosen job
+#define KEY_STATS 'P' // Show or hide the performance counters of the last frame and the latency histograms
 
 #endif
@@ -15,15 +15,387 @@
 #include <fcntl.h>
 #include <pwd.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/sysmacros.h>
 #include <sys/wait.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #include "config.h"
 
 #define KEY_CHPANE 9 // Tab key to change the pane
 #define KEY_RETURN 10
 #define LEFT 0
 #define RIGHT 1
+#define JOURNAL_MAGIC "NFMCLIP1"
+#define JOURNAL_DATA 4096 // The records follow the page with the header
+#define JOURNAL_ADD 1
+#define JOURNAL_REMOVE 2
+#define JOURNAL_CLEAR 3
+#define SNAPSHOT_MAGIC "NFMSNAP2"
+#define LOAD_RUNNING 0
+#define LOAD_DONE 1
+#define LOAD_CANCELLED 2
+#define LOAD_WAIT 50 // A directory read faster than this is shown at once, without the partial lists (ms)
+#define LOAD_REFRESH 100 // The entries read so far are shown every 100 milliseconds
+#define TASK_SCAN 0
+#define TASK_COPY 1
+#define TASK_DELETE 2
+#define TASK_MOVE 3
+#define SORT_ALPHA 0
+#define SORT_NATURAL 1
+#define SORT_SIZE 2
+#define SORT_MTIME 3
+#define SORT_EXT 4
+#define SORT_KEY_MAX 8192 // The longest sort key of a name (bytes)
+#define SORT_SMALL 32 // Fewer entries are sorted by insertion
+#define SORT_PARALLEL 65536 // More entries are sorted by several threads
+#define MAX_DEVICES 16 // Devices used by the jobs at the same time
+#define COPY_CHUNK 16777216 // The progress is updated after every chunk (bytes)
+#define META_QUEUE 256 // Files waiting for the workers, the oldest requests are dropped
+#define DETAILS_NAME 16 // The columns are shown only if this much of the name still fits
+#define FINDER_MAX 67108864 // The most files the finder keeps, the address space is reserved at once
+#define FINDER_BATCH 256 // The found files are published in batches
+#define FINDER_CHUNK 1048576 // The memory of the found paths is taken in chunks (bytes)
+#define FINDER_SLICE 65536 // Files scored between two checks of the keyboard
+#define USAGE_STALE 0 // The total of the directory has to be found again
+#define USAGE_SCANNING 1
+#define USAGE_DONE 2
+#define USAGE_ROOTS 8 // Directories waiting for a scan, the oldest requests are dropped
+#define USAGE_CHUNK 4096 // The nodes of the scanned directories are allocated in chunks
+#define USAGE_BAR 10 // The width of the bar of the usage column
+#define STATS_LIST 0 // Reading the directories and their metadata, building the views
+#define STATS_SORT 1
+#define STATS_RENDER 2
+#define STATS_FILES 3 // Copying, moving and deleting, starting the programs
+#define STATS_TIMERS 4
+#define HIST_BITS 5 // Each power of two is split in 32 buckets, the values are kept within 3%
+#define HIST_BUCKETS 1024 // The latencies up to 2^36 microseconds
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_CLOSE_WRITE | \
+                    IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+typedef struct entry
+{
+    uint32_t name_off; // The offset of the name in the arena of the listing
+    uint16_t name_len;
+    uint16_t key_len; // The sort key follows the name in the arena
+    unsigned char type; // The d_type of the file
+    int64_t value; // The size or the modification time when the files are sorted by them
+    ino_t ino; // With the device of the directory, finds the details of the file
+}
+entry;
+
+typedef struct listing
+{
+    char *names; // The arena of all file names, each one terminated with '\0'
+    size_t names_len;
+    size_t names_cap;
+    size_t names_used; // The part of the arena taken by the names and keys of the current entries
+    entry *entries; // All files of the directory: directories first, then other files
+    int num;
+    int cap; // The number of allocated entries
+    int *view; // Indexes of the displayed entries (hidden files may be filtered out)
+    int view_num;
+    int view_hide_flag; // The value of hide_flag the view was built with
+    char *folded; // The names of the view, case-folded for the search and separated by '\0'
+    int *folded_starts; // The offset of each name in folded, and the end of the last one
+}
+listing;
+
+typedef struct snapshot_header
+{
+    char magic[8];
+    uint64_t dev; // The directory the snapshot is valid for, while it has the same time
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t order; // The sort mode and the flags the entries are sorted by
+    uint32_t locale; // The hash of the collation the sort keys were made with
+    uint32_t num;
+    uint32_t path_len; // The path follows the header, then the entries and the names
+    uint64_t names_len;
+}
+snapshot_header;
+
+typedef struct loader
+{
+    char *path;
+    int stream; // The entries are shown as they come (1), or replace the listing when all are read (0)
+    listing list; // Read by a worker, taken by the UI when it is done
+    listing batch; // The sorted entries read since the UI took the last ones, guarded by load_lock
+    int batch_split; // The last batch may hold two sorted runs, the second one starts here
+    int loaded; // The number of entries read so far
+    long published; // When the last batch was handed to the UI (ms)
+    struct stat st; // The directory before it was read
+    int error;
+    int cancel; // Changes to 1 when the listing is not needed any more
+    int state; // Whoever comes second, the worker or the UI, frees the loader
+    struct loader *next;
+}
+loader;
+
+typedef struct journal_header
+{
+    char magic[8];
+    uint64_t generation; // Incremented on every change of the journal
+    uint64_t length; // The end of the last record
+    uint64_t epoch; // Incremented when the journal is compacted
+}
+journal_header;
+
+typedef struct journal_record
+{
+    uint32_t len; // The length of the path following the record
+    uint32_t op;
+}
+journal_record;
+
+typedef struct clipboard
+{
+    char **paths; // Selected files in the order of selection, NULL after deselection
+    int len;
+    int cap;
+    int *slots; // Hash table of indexes in 'paths': -1 - empty slot, -2 - deleted
+    int slots_cap; // A power of two
+    int slots_used; // Empty slots are not counted
+    int dirty; // Changes to 1 when the clipboard file is out of date
+    unsigned int changes; // Counts the changes of the selection, the drawn lines are checked against it
+    size_t live; // The size of the journal records needed to restore the selection
+    int journal_fd; // The journal shared by all running instances
+    journal_header *journal; // The memory-mapped header of the journal
+    uint64_t generation; // The generation of the journal the selection corresponds to
+    uint64_t epoch;
+    uint64_t offset; // The end of the records applied to the selection
+    char *pending; // Records not yet written to the journal
+    size_t pending_len;
+    size_t pending_cap;
+}
+clipboard;
+
+typedef struct task
+{
+    char *src;
+    char *dst; // NULL when the task only reads
+    int kind;
+    dev_t src_dev;
+    dev_t dst_dev;
+    struct task *root; // The top-level task that the task belongs to
+    int error; // The last error of a top-level task
+    struct task *parent; // The directory removed after its entries
+    int pending; // The task itself and its unfinished subdirectories
+    int remove_dir;
+    struct task *next;
+}
+task;
+
+typedef struct device
+{
+    dev_t dev;
+    int limit; // How many tasks may use the device at the same time
+    int active;
+}
+device;
+
+typedef struct dir_mode
+{
+    char *path;
+    mode_t mode;
+}
+dir_mode;
+
+typedef struct job
+{
+    pthread_mutex_t lock; // Protects the queue and the modes
+    pthread_cond_t cond;
+    int kind;
+    task *roots; // The top-level tasks
+    task *head;
+    task *tail;
+    int running;
+    dir_mode *modes; // Created directories get their modes at the end
+    int modes_num;
+    int modes_cap;
+    long long files_total; // The counters are updated atomically
+    long long files_done;
+    long long bytes_total;
+    long long bytes_done;
+    int errors;
+    char **failed; // The entries that couldn't be processed
+    int failed_num;
+    int failed_cap;
+    long long removed;
+    int phase; // The kind of the tasks that are running
+    int paused;
+    int cancelled;
+    int number; // Shown in the list of jobs
+    int threaded;
+    pthread_t thread;
+    struct timespec start;
+    struct job *next;
+}
+job;
+
+typedef struct radix_job
+{
+    entry *entries;
+    entry *tmp;
+    char *names;
+    int starts[258]; // The buckets of the first byte
+    int next; // The next bucket to sort
+}
+radix_job;
+
+typedef struct ring
+{
+    int fd; // -1 when io_uring is not available
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    struct io_uring_sqe *sqes;
+}
+ring;
+
+typedef struct file_info
+{
+    dev_t dev; // The device and the inode find the details of the file
+    ino_t ino;
+    int ready; // 0 while a worker is reading the file
+    time_t read_at;
+    off_t size;
+    struct timespec mtime; // A changed file is read again
+    mode_t mode; // 0 if the file could not be read
+    char owner[32];
+    char mime[80]; // Empty if the type is not known
+    struct file_info *hash_next; // The next one in the bucket, or the next free one
+    struct file_info *newer; // The list from the least recently used
+    struct file_info *older;
+}
+file_info;
+
+typedef struct preview
+{
+    char *path;
+    struct timespec mtime; // The preview is read again when the file changes
+    off_t size;
+    int error; // errno if the file could not be read
+    int is_dir;
+    listing list; // The files of a directory
+    char *text; // The head of a file, made printable, NULL for a binary file
+}
+preview;
+
+typedef struct walker
+{
+    struct finder *finder;
+    pthread_mutex_t lock; // The queue, other walkers steal from it
+    char **dirs; // The directories to read, relative to the root
+    int head; // Stolen from the head, the owner takes from the tail
+    int tail;
+    int cap;
+    char *buf; // For getdents
+    char *chunk; // The memory of the paths being found
+    size_t chunk_used;
+    char *batch[FINDER_BATCH]; // Published together
+    int batch_num;
+}
+walker;
+
+typedef struct finder
+{
+    char *root;
+    dev_t dev; // The walk stays on the device of the root, as find -xdev
+    int hidden; // hide_flag when the finder was opened
+    char **results; // The found paths relative to the root, the first num are published
+    int num;
+    pthread_mutex_t lock; // Publishing, the counters of the directories and the chunks
+    pthread_cond_t cond;
+    int queued; // Directories waiting in the queues
+    int pending; // Directories waiting or being read
+    int cancelled;
+    char **chunks;
+    int chunks_num;
+    int chunks_cap;
+    walker walkers[FINDER_THREADS];
+    pthread_t threads[FINDER_THREADS];
+    int threads_num;
+}
+finder;
+
+typedef struct fuzzy_match
+{
+    uint32_t index; // Of the path in the results
+    int score;
+}
+fuzzy_match;
+
+typedef struct usage_node
+{
+    dev_t dev; // The device and the inode find the directory
+    ino_t ino;
+    struct timespec mtime; // The total is valid while the directory itself has not changed
+    int64_t size; // The disk usage of the subtree, growing while it is scanned
+    int64_t reported; // The part of the size already added to the directories above
+    int state;
+    int pending; // The directory itself and its unfinished subdirectories
+    int links; // The subtree has files with several links, its total is not reused
+    struct usage_node *parent; // The directory it was found in
+    struct usage_node *hash_next;
+}
+usage_node;
+
+typedef struct usage_task
+{
+    usage_node *node;
+    char *path;
+}
+usage_task;
+
+typedef struct usage_link
+{
+    dev_t dev;
+    ino_t ino; // 0 for an empty slot
+}
+usage_link;
+
+typedef struct meta_request
+{
+    dev_t dev;
+    ino_t ino;
+    char *path;
+}
+meta_request;
+
+typedef struct stats
+{
+    int64_t entries; // The directory entries read
+    int64_t syscalls; // Made to read the directories and to start the programs
+    int64_t time[STATS_TIMERS]; // Nanoseconds, summed over the threads
+    int64_t allocs; // An estimate: the allocations of the listings, their sorting and their search index
+}
+stats;
+
+typedef struct histogram
+{
+    int64_t counts[HIST_BUCKETS]; // Log-linear buckets of microseconds, as HdrHistogram keeps them
+    int64_t total;
+    int64_t max;
+}
+histogram;
 
 typedef struct pane
 {
@@ -35,12 +407,30 @@ typedef struct pane
     int files_num;
     int top_index; // The file index to print the first line of the current window
     int select; // The position of the selected line in the window
+    listing list; // The cached contents of the current directory
+    int list_dirty; // Changes to 1 when the directory has to be re-read
+    struct stat list_st; // The directory status at the moment of reading
+    int watch_wd; // The inotify watch descriptor of the current directory
+    int *rows; // What is drawn on each line of the window
+    int drawn_top; // The top_index of the drawn lines
+    unsigned int drawn_changes; // The changes of the clipboard the drawn lines were printed with
+    int redraw; // Changes to 1 when all the lines have to be drawn again
+    int *matches; // The indexes of the files matching search_substr
+    int matches_num;
+    int matches_ok; // Changes to 0 when the view or the searched string change
+    int match_pos; // The match the cursor has been moved to
+    char *jump_name; // The file to put the cursor on when the directory is read
+    int usage_generation; // The totals the sizes of the directories were taken from
+    int64_t usage_total; // The disk usage of the directory in the usage mode
+    int64_t usage_max; // The largest file, it fills the bar of the usage column
+    int usage_scanning; // Changes to 1 while the total is still growing
+    loader *load; // Reads the directory shown from its snapshot again, NULL if none
 }
 pane;
 
 /* Globals */
-pane left_pane  = { .select = 1 };
-pane right_pane = { .select = 1 };
+pane left_pane  = { .select = 1, .list_dirty = 1, .watch_wd = -1 };
+pane right_pane = { .select = 1, .list_dirty = 1, .watch_wd = -1 };
 WINDOW *status_bar;
 WINDOW *bookmarks;
 int pane_flag = LEFT; // 0 - the active panel on the left; 1 - the active panel on the right
@@ -49,16 +439,94 @@ struct passwd *user_data;
 char *conf_path = NULL; // The path to the configuration directory
 char *clipboard_path = NULL;
 char *bookmarks_path = NULL;
+char *snapshots_path = NULL; // The listings of the large directories
+char *stats_path = NULL; // The latency histograms are written here on exit
 int clipboard_num = 0; // The number of files on the clipboard
+clipboard clipboard_set = { .journal_fd = -1 }; // The selected files are kept in memory
+char *journal_path = NULL;
 char *editor = NULL; // Default editor
 char *shell = NULL; // Default shell
 int bookmarks_num = 0; // The number of bookmarks
 sigset_t signal_set; // Represent a signal set to specify what signals are affected
+mode_t file_mask; // The umask of the process
 int back_flag = 0; // Changes to 1 after returning to parent directory
 int hide_flag = HIDDENVIEW;
+int sort_mode = SORTMODE;
+int dirs_first = DIRSFIRST;
+__thread ring stat_ring = { .fd = -1 }; // Reads the metadata of the files for sorting, one for each loader
 char *search_substr = NULL; // Substring to search
-int search_dir_index = -1; // The pointer to the search result in the directory list
-int search_file_index = -1; // The pointer to the search result in the file list
+int inotify_fd = -1; // Reports changes in the directories of both panes
+job *jobs = NULL; // Background jobs, the list is used only by the UI thread
+int jobs_num = 0;
+int jobs_pipe[2] = { -1, -1 }; // The workers send the finished jobs through it
+device devices[MAX_DEVICES]; // Shared by all jobs, two jobs don't make a hard disk seek between them
+int devices_num = 0;
+unsigned devices_changes = 0; // Incremented when a task leaves its devices
+pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t devices_cond = PTHREAD_COND_INITIALIZER; // The workers wait for the devices of their tasks
+int details = DETAILS;
+int mime_colors = MIME_COLORS;
+magic_t magic_cookie = NULL; // Loaded when the first file is opened
+__thread magic_t worker_cookie = NULL; // libmagic is not thread-safe, each worker loads its own
+file_info meta_pool[META_CACHE]; // The details of the recently displayed files
+file_info *meta_table[META_CACHE * 2];
+file_info *meta_free = NULL;
+int meta_used = 0; // The entries of the pool taken at least once
+file_info *meta_newest = NULL;
+file_info *meta_oldest = NULL;
+meta_request meta_queue[META_QUEUE]; // Read from the newest, the visible files are probably there
+int meta_head = 0;
+int meta_count = 0;
+int meta_threads = 0;
+pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t meta_cond = PTHREAD_COND_INITIALIZER;
+int meta_pipe[2] = { -1, -1 }; // The workers tell that new details or previews are ready
+int preview_mode = 0; // Changes to 1 when the inactive pane shows the selected file
+char *preview_path = NULL; // The file shown in the preview
+char *preview_request = NULL; // The file for the worker, NULL when it has been taken
+int preview_cancel = 0; // Changes to 1 when the file being read is not needed any more
+int preview_started = 0;
+preview *previews[PREVIEW_CACHE]; // The most recently shown first
+pthread_mutex_t preview_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t preview_cond = PTHREAD_COND_INITIALIZER;
+char *job_names[] = { "scan", "copy", "delete", "move" };
+int usage_mode = 0; // Changes to 1 when the files are sorted by the disk usage of their subtrees
+usage_node **usage_table = NULL; // The scanned directories, a power of two buckets
+int usage_table_cap = 0;
+int usage_nodes_num = 0;
+usage_node *usage_chunk = NULL; // The nodes are never freed, the parents point to them
+int usage_chunk_used = 0;
+usage_task *usage_tasks = NULL; // The directories waiting for the workers, read from the newest
+int usage_tasks_num = 0;
+int usage_tasks_cap = 0;
+char *usage_roots[USAGE_ROOTS]; // The directories to scan after the current one
+int usage_roots_num = 0;
+usage_node *usage_root = NULL; // The top of the running scan, NULL if none is running
+dev_t usage_dev; // The scan stays on the device of its top, as du -x
+usage_link *usage_links = NULL; // The files with several links counted in the running scan
+int usage_links_cap = 0;
+int usage_links_used = 0;
+int usage_cancel = 0; // Changes to 1 when the running scan is not needed any more
+int usage_threads = 0;
+int usage_ready = 0; // Changes to 1 when the workers have found new totals
+int usage_generation = 0; // Incremented by the UI thread for each batch of new totals
+long usage_notified = 0; // When the UI was last woken up by the workers (milliseconds)
+pthread_mutex_t usage_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t usage_cond = PTHREAD_COND_INITIALIZER;
+loader *load_queue = NULL; // The directories waiting for the loaders
+int load_idle = 0; // The loaders waiting for a directory, one that hangs on a slow mount is not counted
+int load_queued = 0;
+pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t load_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t load_done = PTHREAD_COND_INITIALIZER; // The UI waits a little for small directories
+stats frame_stats; // Counted by all threads since the last frame was drawn
+stats last_stats; // Shown in the overlay
+histogram key_latency; // From a keypress to the frame that answers it, while the overlay is shown
+histogram frame_latency; // From the start of a frame to the refresh of the terminal
+int64_t key_time = 0; // When the last key was read, 0 when its frame has been drawn (ns)
+int stats_mode = 0; // Changes to 1 while the performance overlay is shown
+int stats_shown = 0; // Changes to 1 when the overlay is opened, the histograms are saved on exit
+WINDOW *stats_win = NULL;
 
 /* Prototypes */
 void init_common(int, char *[]);
@@ -69,16 +537,62 @@ void init_current_dir(char *);
 void init_parent_dir(char *);
 void make_conf_dir(char *);
 void init_curses(void);
-void get_number_of_files(pane *);
-void get_files_in_array(char *, char *[], char *[]);
-int compare_elements(const void *, const void *);
+void update_listing(pane *);
+void check_listing(pane *);
+void invalidate_listings(void);
+void watch_dir(pane *);
+int wait_input(WINDOW *);
+int read_key(WINDOW *);
+void read_events(void);
+void apply_event(pane *, const struct inotify_event *);
+int insert_entry(pane *, const char *, int);
+void remove_entry(pane *, const char *, int);
+int lookup_entry(listing *, const char *, unsigned char, int64_t);
+int find_entry(listing *, const entry *);
+void get_files_in_array(pane *);
+int read_listing(listing *, const char *, const int *, loader *);
+uint32_t add_name(listing *, const char *, size_t, uint16_t *);
+size_t make_sort_key(const char *, char *);
+void read_metadata(listing *, int, ring *);
+void stat_batch(ring *, listing *, int, int, int, struct statx *);
+void init_ring(ring *, unsigned);
+int64_t get_sort_value(int64_t, int64_t, int64_t, long);
+int is_sorted_by_value(void);
+void compact_names(listing *);
+int compare_elements(const void *, const void *, void *);
+void sort_listing(listing *);
+void radix_sort(entry *, entry *, int, int, char *);
+void radix_split(entry *, entry *, int, int, char *, int *);
+void *radix_worker(void *);
+void insertion_sort(entry *, int, char *);
+void filter_listing(pane *);
+char *get_name(pane *, int);
+char *entry_name(listing *, int);
+void free_listing(listing *);
+int load_snapshot(pane *);
+void save_snapshot(const char *, struct stat *, listing *);
+void prune_snapshots(void);
+char *get_snapshot_path(const char *);
+uint32_t get_snapshot_order(void);
+void start_loader(pane *, int);
+void wait_loader(pane *, int);
+void stop_loader(pane *);
+void finish_loader(pane *);
+void publish_entries(loader *, listing *, int, int);
+void take_entries(pane *);
+void merge_entries(listing *, entry *, int);
+void free_loader(loader *);
+void *run_loader(void *);
+void go_to_name(pane *, const char *);
 void make_windows(void);
 void refresh_windows(void);
 WINDOW *create_window(int, int, int, int);
-void restore_indexes(char *[], pane *);
-void print_files(pane *, char *[], char *[]);
-int print_list(pane *, char *[], int, int, int, int);
-char *get_select_path(int, char *[], pane *);
+void close_window(WINDOW *);
+void restore_indexes(pane *);
+void print_files(pane *);
+void print_row(pane *, int, int);
+int get_row_state(pane *, int, int);
+char *get_select_path(int, pane *);
 void print_line(WINDOW *, int, char *);
 void go_down(pane *);
 void go_up(pane *);
@@ -91,32 +605,144 @@ void highlight_active_pane(int, int);
 void print_status(pane *);
 void print_notification(char *);
 char *get_human_filesize(double, char *);
+int get_meta(pane *, int, file_info *);
+void request_meta(file_info *, char *);
+void *run_meta_worker(void *);
+void read_meta(void);
+void forget_meta(pane *, const char *);
+file_info *find_meta(dev_t, ino_t);
+file_info *add_meta(dev_t, ino_t);
+void drop_meta(file_info *);
+void use_meta(file_info *);
+void print_details(pane *, int, int);
+int get_details(file_info *, char *, int);
+void clear_meta(void);
+const char *get_mime_type(magic_t *, const char *);
+const char *get_mime_by_ext(const char *);
+int get_mime_color(const char *);
 int exist_clipboard(char *);
+int find_clipboard(const char *);
+unsigned int hash_path(const char *);
 void append_clipboard(char *);
 void remove_clipboard(char *);
+void clear_clipboard(void);
+int insert_clipboard(const char *);
+int delete_clipboard(const char *);
+void rehash_clipboard(void);
+void empty_clipboard(void);
+void save_clipboard(void);
+void init_journal(void);
+int lock_journal(int, short, off_t);
+void write_journal(int, const char *);
+void sync_clipboard(void);
+void read_journal(void);
+void compact_journal(void);
+void close_clipboard(void);
 void remove_files(pane *);
-int rm_file(char *);
+int rm_file(job *, char *);
+void delete_task(job *, task *);
 void yank_files(pane *);
-int cp_file(char *, char *);
+int cp_file(job *, char *, char *);
+void copy_task(job *, task *);
+void fail_task(job *, task *);
+void scan_task(job *, task *);
+int copy_file(int, const char *, int, const char *, job *);
+int copy_data(int, int, off_t, job *);
+int copy_range(int, int, off_t, off_t, job *);
+int backup_file(int, const char *);
+job *new_job(int);
+void free_job(job *);
+void push_task(job *, int, const char *, const char *);
+void push_child_task(job *, task *, const char *, dev_t, dev_t);
+void queue_task(job *, task *);
+void start_job(job *);
+void *run_job(void *);
+void run_phase(job *, int);
+int check_job(job *);
+void read_jobs(void);
+void reap_job(job *);
+void wait_jobs(void);
+void cancel_job(job *);
+void manage_jobs(void);
+void *run_worker(void *);
+task *take_task(job *, unsigned *);
+void finish_task(job *, task *);
+void release_devices(dev_t, dev_t);
+void add_failure(job *, const char *, const char *, int);
+void print_failures(job *, char *);
+device *get_device(dev_t);
+int is_rotational(dev_t);
+void print_jobs(void);
+char *get_job_progress(job *, char *, size_t);
 void move_files(pane *);
-int mv_file(char *, char *);
+int mv_file(job *, char *, int, char *);
+int is_inside(int, const struct stat *);
 void rename_file(pane *);
 int is_empty_str(const char *);
 void open_shell(pane *);
 void select_all(pane *);
-void add_list_clipboard(char *[], char *, int);
 void make_new(pane *, char *);
-void preview_select(pane *);
+void print_preview(pane *, pane *);
+void request_preview(const char *);
+void *run_previewer(void *);
+preview *read_preview(const char *, struct stat *);
+preview *find_preview(const char *);
+void store_preview(preview *);
+void free_preview(preview *);
 int get_bookmarks_num(void);
 int exist_bookmark(char);
 void add_bookmark(char *, char);
 void print_bookmarks(void);
 void open_bookmark(char, pane *);
 void remove_bookmark(char);
-int search_dir(pane *, char *, int);
-int search_file(pane *, char *, int);
-int search_list(char *, char *[], int, int);
-void free_array(char *[], int);
+void search_as_you_type(pane *);
+void search_matches(pane *, const char *);
+void refine_matches(pane *, const char *);
+void go_to_match(pane *, int);
+void go_to_index(pane *, int);
+void build_search_index(listing *);
+void fold_case(char *, const char *, size_t);
+void find_files(pane *);
+void print_finder(WINDOW *, finder *, const char *, fuzzy_match *, int, int, int);
+int get_top_matches(fuzzy_match *, int, fuzzy_match *, int);
+int fuzzy_score(const char *, const char *, int);
+finder *start_finder(const char *);
+void stop_finder(finder *);
+void *run_walker(void *);
+char *take_dir(walker *);
+void walk_dir(walker *, char *);
+void push_dir(walker *, char *);
+char *store_path(walker *, const char *, const char *, size_t);
+void publish_results(walker *);
+void update_usage(pane *);
+void print_usage(pane *, int, int);
+void request_usage(const char *);
+void stop_usage(void);
+void *run_usage_worker(void *);
+void start_usage(void);
+void scan_usage(usage_task *);
+void push_usage(usage_node *, char *);
+void finish_usage(usage_node *);
+void notify_usage(int);
+usage_node *find_usage(dev_t, ino_t);
+usage_node *add_usage(dev_t, ino_t);
+int add_link(dev_t, ino_t);
+const char *find_substr(const char *, size_t, const char *, size_t);
+const char *find_substr_sse2(const char *, size_t, const char *, size_t);
+const char *find_substr_avx2(const char *, size_t, const char *, size_t);
+int64_t get_ns(void);
+int64_t start_timer(void);
+void count_stats(int64_t *, int64_t);
+void count_time(int, int64_t);
+void end_frame(int64_t, int64_t);
+void record_latency(histogram *, int64_t);
+int get_hist_bucket(int64_t);
+int64_t get_hist_value(int);
+int64_t get_percentile(histogram *, int);
+void print_stats(void);
+void print_latency(WINDOW *, int, const char *, const char *, histogram *);
+void save_stats(void);
+void write_histogram(FILE *, const char *, histogram *);
 void take_action(int, pane *);
 
 int main(int argc, char *argv[])
@@ -129,33 +755,24 @@ int main(int argc, char *argv[])
 
     do
     {
+        int64_t frame_start = start_timer();
+        sync_clipboard(); // Exchange the changes of the clipboard with other instances
         getmaxyx(stdscr, termsize_y, termsize_x); // Get term size
         termsize_y--; // For status bar
         make_windows();
-        get_number_of_files(&left_pane);
-        get_number_of_files(&right_pane);
-
-        /* Fill in variable-length arrays of all files in the current directory */
-        char *dirs_list_l[left_pane.dirs_num];
-        char *dirs_list_r[right_pane.dirs_num];
-        char *files_list_l[left_pane.files_num];
-        char *files_list_r[right_pane.files_num];
-        get_files_in_array(left_pane.path, dirs_list_l, files_list_l);
-        get_files_in_array(right_pane.path, dirs_list_r, files_list_r);
-
-        /* Sorting files in dir alphabetically */
-        qsort(dirs_list_l, left_pane.dirs_num, sizeof(char *), compare_elements);
-        qsort(files_list_l, left_pane.files_num, sizeof(char *), compare_elements);
-        qsort(dirs_list_r, right_pane.dirs_num, sizeof(char *), compare_elements);
-        qsort(files_list_r, right_pane.files_num, sizeof(char *), compare_elements);
+        werase(status_bar); // Both lines are printed on every frame
+
+        /* Re-read the directories only if they have changed */
+        update_listing(&left_pane);
+        update_listing(&right_pane);
 
         /* Update 'select' and 'top_index' after go_previous() */
         if (back_flag == 1)
         {
             if (pane_flag == LEFT)
-                restore_indexes(dirs_list_l, &left_pane);
+                restore_indexes(&left_pane);
             else if (pane_flag == RIGHT)
-                restore_indexes(dirs_list_r, &right_pane);
+                restore_indexes(&right_pane);
             else
             {
                 endwin();
@@ -164,24 +781,39 @@ int main(int argc, char *argv[])
             }
         }
 
-        /* Print and refresh */
-        print_files(&left_pane, dirs_list_l, files_list_l);
-        print_files(&right_pane, dirs_list_r, files_list_r);
+        /* Print and refresh, the inactive pane may show the preview of the selected file */
+        int64_t render_start = start_timer();
+        if (preview_mode == 1 && pane_flag == LEFT)
+        {
+            print_files(&left_pane);
+            print_preview(&right_pane, &left_pane);
+        }
+        else if (preview_mode == 1)
+        {
+            print_files(&right_pane);
+            print_preview(&left_pane, &right_pane);
+        }
+        else
+        {
+            print_files(&left_pane);
+            print_files(&right_pane);
+        }
 
         if (pane_flag == LEFT)
         {
             highlight_active_pane(0, 0);
             print_status(&left_pane);
+            if (stats_mode == 1)
+                print_stats();
             refresh_windows();
+            end_frame(frame_start, render_start);
 
             /* Keybindings */
-            keypress = wgetch(left_pane.win);
+            keypress = wait_input(left_pane.win);
             if (keypress == ERR)
             {
-                free_array(dirs_list_l, left_pane.dirs_num);
-                free_array(files_list_l, left_pane.files_num);
-                free_array(dirs_list_r, right_pane.dirs_num);
-                free_array(files_list_r, right_pane.files_num);
+                check_listing(&left_pane);
+                check_listing(&right_pane);
                 continue;
             }
             take_action(keypress, &left_pane);
@@ -190,16 +822,17 @@ int main(int argc, char *argv[])
         {
             highlight_active_pane(0, termsize_x / 2);
             print_status(&right_pane);
+            if (stats_mode == 1)
+                print_stats();
             refresh_windows();
+            end_frame(frame_start, render_start);
 
             /* Keybindings */
-            keypress = wgetch(right_pane.win);
+            keypress = wait_input(right_pane.win);
             if (keypress == ERR)
             {
-                free_array(dirs_list_l, left_pane.dirs_num);
-                free_array(files_list_l, left_pane.files_num);
-                free_array(dirs_list_r, right_pane.dirs_num);
-                free_array(files_list_r, right_pane.files_num);
+                check_listing(&left_pane);
+                check_listing(&right_pane);
                 continue;
             }
             take_action(keypress, &right_pane);
@@ -210,28 +843,38 @@ int main(int argc, char *argv[])
             perror("pane_flag initialization error\n");
             exit(EXIT_FAILURE);
         }
-
-        free_array(dirs_list_l, left_pane.dirs_num);
-        free_array(files_list_l, left_pane.files_num);
-        free_array(dirs_list_r, right_pane.dirs_num);
-        free_array(files_list_r, right_pane.files_num);
     }
     while (keypress != 'q');
 
+    /* Don't leave the copied files half-written */
+    wait_jobs();
+
     /* Emptying the clipboard */
-    remove(clipboard_path);
+    close_clipboard();
 
+    if (stats_shown == 1)
+        save_stats();
+
+    stop_loader(&left_pane);
+    stop_loader(&right_pane);
+    free_listing(&left_pane.list);
+    free_listing(&right_pane.list);
     free(left_pane.path);
     free(left_pane.select_path);
     free(left_pane.parent_dirname);
+    free(left_pane.jump_name);
     free(right_pane.path);
     free(right_pane.select_path);
     free(right_pane.parent_dirname);
+    free(right_pane.jump_name);
     free(editor);
     free(shell);
     free(conf_path);
     free(clipboard_path);
+    free(journal_path);
     free(bookmarks_path);
+    free(snapshots_path);
+    free(stats_path);
     free(search_substr);
 
     endwin();
@@ -248,6 +891,21 @@ void init_common(int argc, char *argv[])
     set_shell();
     init_paths(argc, argv);
     make_conf_dir(conf_path);
+    if (SNAPSHOTS == 1)
+        make_conf_dir(snapshots_path);
+    file_mask = umask(0);
+    umask(file_mask);
+
+    /* Watch the directories of the panes instead of re-reading them periodically */
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    init_journal();
+
+    if (pipe2(jobs_pipe, O_CLOEXEC) == -1 || fcntl(jobs_pipe[0], F_SETFL, O_NONBLOCK) == -1 ||
+        pipe2(meta_pipe, O_CLOEXEC | O_NONBLOCK) == -1)
+    {
+        perror("pipe initialization error\n");
+        exit(EXIT_FAILURE);
+    }
 
     /* Setting a mask to block/unblock SIGWINCH (term window size changed) */
     sigemptyset (&signal_set);
@@ -430,6 +1088,16 @@ void init_paths(int argc, char *argv[])
     }
     snprintf(clipboard_path, alloc_size + 1, "%s/clipboard", conf_path);
 
+    /* Set the path for the clipboard journal */
+    alloc_size = snprintf(NULL, 0, "%s/clipboard.journal", conf_path);
+    journal_path = malloc(alloc_size + 1);
+    if (journal_path == NULL)
+    {
+        perror("clipboard initialization error\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(journal_path, alloc_size + 1, "%s/clipboard.journal", conf_path);
+
     /* Set the path for the bookmarks file */
     alloc_size = snprintf(NULL, 0, "%s/bookmarks", conf_path);
     bookmarks_path = malloc(alloc_size + 1);
@@ -439,6 +1107,26 @@ void init_paths(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
     snprintf(bookmarks_path, alloc_size + 1, "%s/bookmarks", conf_path);
+
+    /* Set the path for the snapshots of the directories */
+    alloc_size = snprintf(NULL, 0, "%s/snapshots", conf_path);
+    snapshots_path = malloc(alloc_size + 1);
+    if (snapshots_path == NULL)
+    {
+        perror("snapshots initialization error\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(snapshots_path, alloc_size + 1, "%s/snapshots", conf_path);
+
+    /* Set the path for the latency histograms */
+    alloc_size = snprintf(NULL, 0, "%s/stats", conf_path);
+    stats_path = malloc(alloc_size + 1);
+    if (stats_path == NULL)
+    {
+        perror("stats initialization error\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(stats_path, alloc_size + 1, "%s/stats", conf_path);
 }
 
 void init_current_dir(char *path)
@@ -492,1118 +1180,5918 @@ void init_curses()
     initscr();
     noecho();
     curs_set(0); // Hide the cursor
-    halfdelay(REFRESH);
+    cbreak();
     start_color();
     init_pair(1, COLOR_CYAN, 0); // Colors : directory
     init_pair(2, COLOR_RED, 0);  // Colors : active pane; files from clipboard
+    init_pair(3, COLOR_MAGENTA, 0); // Colors : images
+    init_pair(4, COLOR_YELLOW, 0); // Colors : audio and video
+    init_pair(5, COLOR_BLUE, 0); // Colors : archives
+    init_pair(6, COLOR_GREEN, 0); // Colors : executables
 }
 
-void get_number_of_files(pane *pane)
+void update_listing(pane *pane)
 {
-    DIR *pDir;
-    struct dirent *pDirent;
-    pane->dirs_num = 0;
-    pane->files_num = 0;
-
-    if ((pDir = opendir(pane->path)) != NULL)
+    if (pane->list_dirty == 1)
     {
-        while ((pDirent = readdir(pDir)) != NULL)
-        {
-            if (strcmp(pDirent->d_name, "..") == 0 || strcmp(pDirent->d_name, ".") == 0)
-                continue;
-            if (hide_flag == 0 && pDirent->d_name[0] == '.')
-                continue;
-            if (pDirent->d_type == DT_DIR)
-                pane->dirs_num += 1;
-            else
-                pane->files_num += 1;
-        }
+        watch_dir(pane); // Before reading, so that no change is missed
+        stop_loader(pane);
+        free_listing(&pane->list);
+        pane->list.view_hide_flag = -1;
+        if (stat(pane->path, &pane->list_st) == -1)
+            memset(&pane->list_st, 0, sizeof(struct stat));
+
+        /* A large directory is shown from its snapshot at once and read again in the background */
+        if (SNAPSHOTS == 1 && load_snapshot(pane) == 0)
+            start_loader(pane, 0);
+        else
+            get_files_in_array(pane);
+        pane->list_dirty = 0;
     }
-    closedir(pDir);
-}
+    else if (pane->load != NULL && __atomic_load_n(&pane->load->state, __ATOMIC_ACQUIRE) == LOAD_DONE)
+        finish_loader(pane);
+    else if (pane->load != NULL && pane->load->stream == 1)
+        take_entries(pane);
 
-void get_files_in_array(char *directory, char *dirs[], char *files[])
-{
-    DIR *pDir;
-    struct dirent *pDirent;
-    int i = 0;
-    int j = 0;
+    /* The directories are sorted again when the scan has found new totals */
+    if (usage_mode == 1 && (pane->list.view_hide_flag != hide_flag || pane->usage_generation != usage_generation))
+        update_usage(pane);
+
+    /* Filter hidden files from memory without reading the directory again */
+    if (pane->list.view_hide_flag != hide_flag)
+    {
+        filter_listing(pane);
+        pane->redraw = 1;
+    }
 
-    if ((pDir = opendir(directory)) != NULL)
+    /* The cursor is put on the file chosen in the finder, a directory still read may bring it later */
+    if (pane->jump_name != NULL)
     {
-        while ((pDirent = readdir(pDir)) != NULL)
+        int found = 0;
+        for (int i = 0; i < pane->list.view_num; i++)
         {
-            if (strcmp(pDirent->d_name, "..") == 0 || strcmp(pDirent->d_name, ".") == 0)
-                continue;
-            if (hide_flag == 0 && pDirent->d_name[0] == '.')
-                continue;
-            if (pDirent->d_type == DT_DIR)
-            {
-                dirs[i] = strdup(pDirent->d_name);
-                i++;
-            }
-            else
+            if (strcmp(get_name(pane, i), pane->jump_name) == 0)
             {
-                files[j] = strdup(pDirent->d_name);
-                j++;
+                go_to_index(pane, i);
+                found = 1;
+                break;
             }
         }
+        if (found == 1 || pane->load == NULL || pane->load->stream == 0)
+        {
+            free(pane->jump_name);
+            pane->jump_name = NULL;
+        }
+    }
+
+    /* Keep the cursor inside the list if files have disappeared */
+    int num = pane->dirs_num + pane->files_num;
+    if (pane->top_index + pane->select > num)
+    {
+        if (pane->top_index >= num)
+            pane->top_index = (num > termsize_y - 2) ? num - (termsize_y - 2) : 0;
+        pane->select = (num > pane->top_index) ? num - pane->top_index : 1;
     }
-    closedir(pDir);
 }
 
-int compare_elements(const void *arg1, const void *arg2)
+void check_listing(pane *pane)
 {
-    char * const *p1 = arg1;
-    char * const *p2 = arg2;
-    return strcasecmp(*p1, *p2);
+    if (pane->watch_wd != -1)
+        return; // inotify reports the changes
+    struct stat st;
+    if (stat(pane->path, &st) == -1)
+    {
+        pane->list_dirty = 1;
+        return;
+    }
+    if (st.st_ino != pane->list_st.st_ino || st.st_dev != pane->list_st.st_dev ||
+        st.st_mtim.tv_sec != pane->list_st.st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != pane->list_st.st_mtim.tv_nsec)
+        pane->list_dirty = 1;
 }
 
-void make_windows()
+void invalidate_listings()
 {
-    left_pane.win  = create_window(termsize_y, termsize_x / 2 + 1, 0, 0);
-    right_pane.win = create_window(termsize_y, termsize_x / 2 + 1, 0, termsize_x / 2);
-    status_bar = create_window(2, termsize_x, termsize_y - 1, 0);
-    keypad (left_pane.win, TRUE);
-    keypad (right_pane.win, TRUE);
-    sigprocmask(SIG_UNBLOCK, &signal_set, NULL); // Unblock SIGWINCH
+    left_pane.list_dirty = 1;
+    right_pane.list_dirty = 1;
 }
 
-void refresh_windows()
+void watch_dir(pane *pane)
 {
-    wrefresh(left_pane.win);
-    wrefresh(right_pane.win);
-    wrefresh(status_bar);
+    if (inotify_fd == -1)
+        return;
+
+    /* Both panes get the same watch descriptor for the same directory */
+    struct pane *other = (pane == &left_pane) ? &right_pane : &left_pane;
+    if (pane->watch_wd != -1 && pane->watch_wd != other->watch_wd)
+        inotify_rm_watch(inotify_fd, pane->watch_wd);
+    pane->watch_wd = inotify_add_watch(inotify_fd, pane->path, WATCH_MASK);
 }
 
-WINDOW *create_window(int height, int width, int starty, int startx)
+int wait_input(WINDOW *win)
 {
-    WINDOW *win;
-    win = newwin(height, width, starty, startx);
-    return win;
+    struct pollfd fds[4] = { { STDIN_FILENO, POLLIN, 0 }, { jobs_pipe[0], POLLIN, 0 }, { meta_pipe[0], POLLIN, 0 },
+                             { inotify_fd, POLLIN, 0 } };
+    int keypress;
+
+    /* Sleep until a key is pressed or the directories have changed */
+    wtimeout(win, 0);
+    while ((keypress = read_key(win)) == ERR)
+    {
+        int timeout = -1;
+        if (left_pane.watch_wd == -1 || right_pane.watch_wd == -1)
+            timeout = REFRESH * 100; // Fall back to periodic checks
+        if (jobs != NULL)
+            timeout = JOB_REFRESH * 100; // Show the progress of the jobs
+        int ret = poll(fds, (inotify_fd != -1) ? 4 : 3, timeout);
+        if (ret == 0)
+            break;
+        if (ret == -1 && errno != EINTR) // EINTR: SIGWINCH, wgetch returns KEY_RESIZE
+        {
+            endwin();
+            perror("poll error\n");
+            exit(EXIT_FAILURE);
+        }
+        if (ret > 0 && (fds[1].revents & POLLIN) != 0)
+        {
+            read_jobs();
+            break;
+        }
+        if (ret > 0 && (fds[2].revents & POLLIN) != 0)
+        {
+            read_meta();
+            break;
+        }
+        if (ret > 0 && (fds[3].revents & POLLIN) != 0)
+        {
+            read_events();
+            break;
+        }
+    }
+    return keypress;
+}
+
+int read_key(WINDOW *win)
+{
+    /* The latency of a frame is measured from the last key it answers */
+    int key = wgetch(win);
+    if (key != ERR && stats_mode == 1)
+        key_time = get_ns();
+    return key;
 }
 
-void restore_indexes(char *dirs[], pane *pane)
+void read_events()
 {
-    for (int i = 0; i < pane->dirs_num; i++)
+    char buf[65536] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    ssize_t len;
+
+    while ((len = read(inotify_fd, buf, sizeof(buf))) > 0)
     {
-        if (strcmp(dirs[i], pane->parent_dirname) == 0)
+        for (char *ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len)
         {
-            if (termsize_y > pane->dirs_num)
-            {
-                pane->top_index = 0;
-                pane->select = i + 1;
-                break;
-            }
-            else if (i < pane->dirs_num - (termsize_y - 2))
-            {
-                pane->top_index = i;
-                pane->select = 1;
-                break;
-            }
-            else
+            event = (const struct inotify_event *) ptr;
+            if ((event->mask & IN_Q_OVERFLOW) != 0)
             {
-                pane->top_index = pane->dirs_num - (termsize_y - 2);
-                pane->select = termsize_y - 1 - (pane->dirs_num - i);
-                break;
+                invalidate_listings(); // Events are lost
+                continue;
             }
+            apply_event(&left_pane, event);
+            apply_event(&right_pane, event);
         }
     }
-    back_flag = 0;
 }
 
-void print_files(pane *pane, char *dirs_list[], char *files_list[])
+void apply_event(pane *pane, const struct inotify_event *event)
 {
-    /* Print directories */
-    wattron(pane->win, A_BOLD);
-    int index = print_list(pane, dirs_list, pane->dirs_num, pane->top_index, 1, 1);
-    wattroff(pane->win, A_BOLD);
-
-    /* Print other types of files */
-    if (pane->top_index < pane->dirs_num)
-        print_list(pane, files_list, pane->files_num, 0, index, 0);
-    else
-        print_list(pane, files_list, pane->files_num, pane->top_index - pane->dirs_num, 1, 0);
+    if (event->wd != pane->watch_wd || pane->list_dirty == 1)
+        return;
+    if ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) != 0)
+    {
+        pane->list_dirty = 1;
+        return;
+    }
+    if (event->len == 0)
+        return;
+    int is_dir = (event->mask & IN_ISDIR) != 0;
+    if ((event->mask & (IN_ATTRIB | IN_CLOSE_WRITE)) != 0)
+    {
+        /* A file is usually created empty and written after, its value is read again */
+        forget_meta(pane, event->name);
+        if (is_sorted_by_value() == 0 || insert_entry(pane, event->name, is_dir) == 0)
+            return;
+    }
+    else if ((event->mask & (IN_CREATE | IN_MOVED_TO)) != 0)
+        insert_entry(pane, event->name, is_dir);
+    else if ((event->mask & (IN_DELETE | IN_MOVED_FROM)) != 0)
+        remove_entry(pane, event->name, is_dir);
+    pane->list.view_hide_flag = -1; // Rebuild the view
 }
 
-int print_list(pane *pane, char *list[], int num, int start_index, int line_pos, int color)
+int insert_entry(pane *pane, const char *name, int is_dir)
 {
-    for (int i = start_index; i < num; i++)
+    /* 1 if the order of the entries has changed */
+    listing *list = &pane->list;
+    entry new = { .type = DT_DIR };
+
+    /* The inode finds the details, the type of a directory is known from the event */
+    char *path = NULL;
+    int alloc_size = snprintf(NULL, 0, "%s/%s", pane->path, name);
+    path = malloc(alloc_size + 1);
+    if (path == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(path, alloc_size + 1, "%s/%s", pane->path, name);
+    struct stat st;
+    int ret = lstat(path, &st);
+    free(path);
+    if (ret == -1)
+        return 0; // Already gone
+    if (is_dir == 0)
+        new.type = IFTODT(st.st_mode);
+    new.ino = st.st_ino;
+    new.value = get_sort_value(st.st_size, st.st_blocks, st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+
+    /* The entry may already be read from the directory, or a file may be renamed over it */
+    int found = lookup_entry(list, name, new.type, new.value);
+    if (found != -1)
     {
-        if (line_pos == pane->select)
+        entry *old = &list->entries[found];
+        if (usage_mode == 1 && old->type == DT_DIR && old->ino == new.ino)
+            new.value = old->value; // The total of the subtree stays
+        new.name_off = old->name_off;
+        new.name_len = old->name_len;
+        new.key_len = old->key_len;
+        if (new.type == old->type && (is_sorted_by_value() == 0 || new.value == old->value))
         {
-            wattron(pane->win, A_STANDOUT); // Highlighting
-            free(pane->select_path);
-            pane->select_path = get_select_path(i, list, pane);
+            *old = new;
+            return 0;
         }
 
-        char *print_path = NULL;
-        int alloc_size = snprintf(NULL, 0, "%s/%s", pane->path, list[i]);
-        print_path = malloc(alloc_size + 1);
-        if (print_path == NULL)
+        /* Taken out and put back where its new value sorts it */
+        memmove(&list->entries[found], &list->entries[found + 1], (list->num - found - 1) * sizeof(entry));
+        list->num--;
+    }
+    else
+    {
+        new.name_len = strlen(name);
+        new.name_off = add_name(list, name, new.name_len, &new.key_len);
+    }
+    int index = find_entry(list, &new);
+
+    if (list->num == list->cap)
+    {
+        list->cap = list->cap * 2 + 16;
+        list->entries = realloc(list->entries, list->cap * sizeof(entry));
+        list->view = realloc(list->view, list->cap * sizeof(int));
+        if (list->entries == NULL || list->view == NULL)
         {
             endwin();
             perror("memory allocation error\n");
             exit(EXIT_FAILURE);
         }
-        if (pane->path[1] == '\0') // For root dir
-            snprintf(print_path, alloc_size + 1, "%s%s", pane->path, list[i]);
-        else
-            snprintf(print_path, alloc_size + 1, "%s/%s", pane->path, list[i]);
+    }
+    memmove(&list->entries[index + 1], &list->entries[index], (list->num - index) * sizeof(entry));
+    list->entries[index] = new;
+    list->num++;
+    return 1;
+}
 
-        /* selecting files on the clipboard */
-        if (exist_clipboard(print_path) == 0)
-        {
-            wattron(pane->win, COLOR_PAIR(2));
-            print_line(pane->win, line_pos, list[i]);
-            wmove(pane->win, line_pos, 0);
-            wprintw(pane->win, ">");
-            wattroff(pane->win, COLOR_PAIR(2));
-        }
-        else
-        {
-            wattron(pane->win, COLOR_PAIR(color));
-            print_line(pane->win, line_pos, list[i]);
-            wattroff(pane->win, COLOR_PAIR(color));
-        }
+void remove_entry(pane *pane, const char *name, int is_dir)
+{
+    listing *list = &pane->list;
+    int found = lookup_entry(list, name, (is_dir != 0) ? DT_DIR : DT_UNKNOWN, 0);
+    if (found != -1)
+    {
+        list->names_used -= list->entries[found].name_len + list->entries[found].key_len + 2;
+        memmove(&list->entries[found], &list->entries[found + 1], (list->num - found - 1) * sizeof(entry));
+        list->num--;
 
-        wattroff(pane->win, A_STANDOUT);
-        free(print_path);
-        line_pos++;
+        /* Removed names are left in the arena until they take up most of it */
+        if (list->names_len > 65536 && list->names_len > 2 * list->names_used)
+            compact_names(list);
     }
+}
 
-    /* Erase the string if last filename is too long */
-    for (int i = line_pos; i < termsize_y; i++)
+int lookup_entry(listing *list, const char *name, unsigned char type, int64_t value)
+{
+    /* The key is placed at the end of the arena only for the time of the search */
+    entry key = { .type = type, .value = value };
+    size_t names_len = list->names_len;
+    int found = -1;
+    key.name_len = strlen(name);
+    key.name_off = add_name(list, name, key.name_len, &key.key_len);
+    for (int i = find_entry(list, &key); i < list->num && compare_elements(&list->entries[i], &key, list->names) == 0; i++)
     {
-        wmove(pane->win, i, 0);
-        wclrtoeol(pane->win);
+        if (strcmp(entry_name(list, i), name) == 0)
+        {
+            found = i;
+            break;
+        }
     }
-    return line_pos;
+    list->names_len = names_len;
+    list->names_used -= key.name_len + key.key_len + 2;
+
+    /* The type or the value in the listing may differ from the ones of the key */
+    for (int i = 0; found == -1 && i < list->num; i++)
+        if (strcmp(entry_name(list, i), name) == 0)
+            found = i;
+    return found;
 }
 
-char *get_select_path(int index, char *list[], pane *pane)
+int find_entry(listing *list, const entry *key)
 {
-    int alloc_size = snprintf(NULL, 0, "%s/%s", pane->path, list[index]);
-    char *path = malloc(alloc_size + 1);
-    if (path == NULL)
+    /* Binary search of the first entry not less than the key */
+    int low = 0;
+    int high = list->num;
+    while (low < high)
     {
-        endwin();
-        perror("memory allocation error\n");
-        exit(EXIT_FAILURE);
+        int mid = low + (high - low) / 2;
+        if (compare_elements(&list->entries[mid], key, list->names) < 0)
+            low = mid + 1;
+        else
+            high = mid;
     }
-    if (pane->path[1] == '\0') // For root dir
-        snprintf(path, alloc_size + 1, "%s%s", pane->path, list[index]);
-    else
-        snprintf(path, alloc_size + 1, "%s/%s", pane->path, list[index]);
-    return path;
+    return low;
 }
 
-void print_line(WINDOW *window, int pos, char *str)
+void get_files_in_array(pane *pane)
 {
-    wmove(window, pos, 0);
-    wclrtoeol(window); // Pre-erase the string for too long file names
-    wmove(window, pos, 2);
-    wprintw(window, "%s\n", str);
+    /* Read by a loader, so that a slow mount does not stop the UI */
+    start_loader(pane, 1);
+    wait_loader(pane, LOAD_WAIT);
 }
 
-void go_down(pane *pane)
+int read_listing(listing *list, const char *path, const int *cancel, loader *load)
 {
-    int num = pane->dirs_num + pane->files_num;
-    pane->select++;
-    if (pane->select > num)
-        pane->select = num;
+    static __thread char *buf = NULL; // Kept between calls, the previews are read by another thread
+    long len;
 
-    /* Scrolling */
-    if (pane->select > termsize_y - 2)
+    if (buf == NULL && (buf = malloc(READDIR_BUF)) == NULL)
     {
-        if (num - pane->top_index > termsize_y - 2)
-            pane->top_index++;
-        pane->select--;
-        wclear(pane->win);
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
     }
 
-}
+    list->num = 0;
+    list->cap = 256;
+    list->entries = malloc(list->cap * sizeof(entry));
+    list->view = malloc(list->cap * sizeof(int));
+    count_stats(&frame_stats.allocs, 2);
+    if (list->entries == NULL || list->view == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
 
-void go_up(pane *pane)
-{
-    pane->select--;
+    int64_t start = start_timer();
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    count_stats(&frame_stats.syscalls, 1);
+    if (fd == -1)
+        return -1;
 
-    /* Scrolling */
-    if (pane->select < 1)
+    /* Read the directory in one pass with as few system calls as possible */
+    while ((len = getdents64(fd, buf, READDIR_BUF)) > 0)
+    {
+        count_stats(&frame_stats.syscalls, 1);
+        if (cancel != NULL && __atomic_load_n(cancel, __ATOMIC_RELAXED) == 1)
+            break; // Nobody waits for the listing any more
+        int num = list->num;
+        for (long pos = 0; pos < len; )
+        {
+            struct dirent64 *pDirent = (struct dirent64 *) (buf + pos);
+            char *name = pDirent->d_name;
+            pos += pDirent->d_reclen;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+
+            if (list->num == list->cap)
+            {
+                list->cap = (list->cap == 0) ? 256 : list->cap * 2; // A published batch leaves it empty
+                list->entries = realloc(list->entries, list->cap * sizeof(entry));
+                list->view = realloc(list->view, list->cap * sizeof(int));
+                count_stats(&frame_stats.allocs, 2);
+                if (list->entries == NULL || list->view == NULL)
+                {
+                    endwin();
+                    perror("memory allocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+
+            entry *new = &list->entries[list->num++];
+            new->type = pDirent->d_type;
+            new->value = 0;
+            new->ino = pDirent->d_ino;
+            if (new->type == DT_UNKNOWN) // Not every file system fills d_type
+            {
+                struct stat st;
+                count_stats(&frame_stats.syscalls, 1);
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+                    new->type = IFTODT(st.st_mode);
+            }
+            new->name_len = strlen(name);
+            new->name_off = add_name(list, name, new->name_len, &new->key_len);
+        }
+        count_stats(&frame_stats.entries, list->num - num);
+        if (load != NULL)
+        {
+            __atomic_add_fetch(&load->loaded, list->num - num, __ATOMIC_RELAXED);
+            count_time(STATS_LIST, start); // The sorting of the batch is counted on its own
+            publish_entries(load, list, fd, 0);
+            start = start_timer();
+        }
+    }
+    count_stats(&frame_stats.syscalls, 2); // The last getdents64 and close
+    count_time(STATS_LIST, start);
+    if (load != NULL)
+        publish_entries(load, list, fd, 1); // The rest, sorted
+    else if (is_sorted_by_value() == 1)
+        read_metadata(list, fd, &stat_ring);
+    close(fd);
+    return 0;
+}
+
+uint32_t add_name(listing *list, const char *name, size_t len, uint16_t *key_len)
+{
+    static __thread char key[SORT_KEY_MAX];
+    *key_len = make_sort_key(name, key);
+    size_t size = len + *key_len + 2;
+    if (list->names_len + size > list->names_cap)
+    {
+        size_t cap = list->names_cap * 2 + 4096;
+        while (list->names_len + size > cap)
+            cap *= 2;
+        if (cap > UINT32_MAX)
+        {
+            endwin();
+            fprintf(stderr, "too many files in the directory\n");
+            exit(EXIT_FAILURE);
+        }
+        list->names = realloc(list->names, cap);
+        count_stats(&frame_stats.allocs, 1);
+        if (list->names == NULL)
+        {
+            endwin();
+            perror("memory allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        list->names_cap = cap;
+    }
+    uint32_t offset = list->names_len;
+    memcpy(list->names + offset, name, len + 1);
+    memcpy(list->names + offset + len + 1, key, *key_len + 1);
+    list->names_len += size;
+    list->names_used += size;
+    return offset;
+}
+
+size_t make_sort_key(const char *name, char *key)
+{
+    /* Names are compared case-insensitively, as strcasecmp does */
+    size_t len = 0;
+    if (sort_mode == SORT_ALPHA && SORT_LOCALE == 1)
+    {
+        len = strxfrm(key, name, SORT_KEY_MAX);
+        if (len < SORT_KEY_MAX)
+            return len;
+        len = 0; // Too long for the buffer, compare the bytes
+    }
+    if (sort_mode == SORT_EXT)
+    {
+        /* The extension comes first, separated by a byte lower than the letters */
+        const char *dot = strrchr(name, '.');
+        for (size_t i = 1; dot != NULL && dot != name && dot[i] != '\0'; i++)
+            key[len++] = (dot[i] >= 'A' && dot[i] <= 'Z') ? dot[i] + 'a' - 'A' : dot[i];
+        key[len++] = '\1';
+    }
+    for (size_t i = 0; name[i] != '\0' && len < SORT_KEY_MAX - 260; )
+    {
+        if (sort_mode == SORT_NATURAL && name[i] >= '0' && name[i] <= '9')
+        {
+            /* A number is kept as '0', the count of its digits and the digits without leading zeros */
+            size_t end = i;
+            while (name[end] >= '0' && name[end] <= '9')
+                end++;
+            while (i < end - 1 && name[i] == '0')
+                i++;
+            while (i < end && len < SORT_KEY_MAX - 260)
+            {
+                size_t digits = (end - i > 255) ? 255 : end - i;
+                key[len++] = '0';
+                key[len++] = digits;
+                memcpy(key + len, name + i, digits);
+                len += digits;
+                i += digits;
+            }
+            i = end;
+        }
+        else
+        {
+            char c = name[i++];
+            key[len++] = (c >= 'A' && c <= 'Z') ? c + 'a' - 'A' : c;
+        }
+    }
+    key[len] = '\0';
+    return len;
+}
+
+void read_metadata(listing *list, int dirfd, ring *ring)
+{
+    /* The sizes and times are read in batches, each batch with one system call */
+    static __thread struct statx stx[STAT_BATCH];
+    int64_t start = start_timer();
+    for (int first = 0; first < list->num; first += STAT_BATCH)
+    {
+        int num = (list->num - first < STAT_BATCH) ? list->num - first : STAT_BATCH;
+        for (int i = 0; i < num; i++)
+            stx[i].stx_mask = 0; // Set by the kernel when the file is read
+        if (ring != NULL && ring->fd != -1)
+            stat_batch(ring, list, first, num, dirfd, stx);
+
+        /* Without io_uring, or if the kernel could not do the batch, one by one */
+        for (int i = 0; i < num; i++)
+        {
+            entry *e = &list->entries[first + i];
+            if (stx[i].stx_mask == 0)
+            {
+                count_stats(&frame_stats.syscalls, 1);
+                if (statx(dirfd, list->names + e->name_off, AT_SYMLINK_NOFOLLOW, STATX_SIZE | STATX_BLOCKS | STATX_MTIME,
+                          &stx[i]) == -1)
+                    continue;
+            }
+            e->value = get_sort_value(stx[i].stx_size, stx[i].stx_blocks, stx[i].stx_mtime.tv_sec,
+                                      stx[i].stx_mtime.tv_nsec);
+        }
+    }
+    count_time(STATS_LIST, start);
+}
+
+void stat_batch(ring *ring, listing *list, int first, int num, int dirfd, struct statx *stx)
+{
+    unsigned tail = *ring->sq_tail;
+    for (int i = 0; i < num; i++)
+    {
+        unsigned index = (tail + i) & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dirfd;
+        sqe->addr = (uintptr_t) (list->names + list->entries[first + i].name_off);
+        sqe->len = STATX_SIZE | STATX_BLOCKS | STATX_MTIME;
+        sqe->off = (uintptr_t) &stx[i];
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        ring->sq_array[index] = index;
+    }
+    __atomic_store_n(ring->sq_tail, tail + num, __ATOMIC_RELEASE);
+
+    /* Submit the whole batch and wait until all of it is done */
+    int submit = num;
+    int completed = 0;
+    while (completed < num)
+    {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, submit, num - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+        count_stats(&frame_stats.syscalls, 1);
+        if (ret == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            /* The queued requests go away with the ring, the files are read one by one */
+            close(ring->fd);
+            ring->fd = -1;
+            return;
+        }
+        if (ret > 0)
+            submit -= ret;
+
+        /* The results are in the statx buffers, a failed file keeps stx_mask 0 */
+        unsigned head = *ring->cq_head;
+        unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        completed += cq_tail - head;
+        __atomic_store_n(ring->cq_head, cq_tail, __ATOMIC_RELEASE);
+    }
+}
+
+void init_ring(ring *ring, unsigned entries)
+{
+    /* The ring is set up by hand, as liburing would do it */
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd == -1)
+        return; // Not supported or disabled, the files are read one by one
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap == 1 && cq_size > sq_size)
+        sq_size = cq_size;
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (single_mmap == 0)
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED || params.sq_entries < entries)
+    {
+        close(fd); // The mappings are left, this does not happen on a working kernel
+        return;
+    }
+
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->sqes = sqes;
+    ring->fd = fd;
+}
+
+int64_t get_sort_value(int64_t size, int64_t blocks, int64_t sec, long nsec)
+{
+    if (usage_mode == 1)
+        return blocks * 512; // The space taken on the disk, as du counts it
+    return (sort_mode == SORT_SIZE) ? size : sec * 1000000000 + nsec;
+}
+
+int is_sorted_by_value()
+{
+    return sort_mode == SORT_SIZE || sort_mode == SORT_MTIME || usage_mode == 1;
+}
+
+void compact_names(listing *list)
+{
+    char *names = malloc(list->names_used + 1);
+    if (names == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t len = 0;
+    for (int i = 0; i < list->num; i++)
+    {
+        size_t size = list->entries[i].name_len + list->entries[i].key_len + 2;
+        memcpy(names + len, entry_name(list, i), size);
+        list->entries[i].name_off = len;
+        len += size;
+    }
+    free(list->names);
+    list->names = names;
+    list->names_len = len;
+    list->names_cap = list->names_used + 1;
+    list->names_used = len;
+}
+
+int compare_elements(const void *arg1, const void *arg2, void *names)
+{
+    const entry *p1 = arg1;
+    const entry *p2 = arg2;
+    if (dirs_first == 1 && (p1->type == DT_DIR) != (p2->type == DT_DIR))
+        return (p1->type == DT_DIR) ? -1 : 1; // Directories first
+
+    /* The largest or the newest files first */
+    if (is_sorted_by_value() == 1 && p1->value != p2->value)
+        return (p1->value > p2->value) ? -1 : 1;
+
+    /* The keys decide, equal keys are ordered by the names */
+    char *name1 = (char *) names + p1->name_off;
+    char *name2 = (char *) names + p2->name_off;
+    int len = (p1->key_len < p2->key_len) ? p1->key_len : p2->key_len;
+    int ret = memcmp(name1 + p1->name_len + 1, name2 + p2->name_len + 1, len);
+    if (ret == 0)
+        ret = p1->key_len - p2->key_len;
+    return (ret != 0) ? ret : strcmp(name1, name2);
+}
+
+void sort_listing(listing *list)
+{
+    int64_t start = start_timer();
+    entry *tmp = malloc(list->num * sizeof(entry) + 1);
+    count_stats(&frame_stats.allocs, 1);
+    if (tmp == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Directories first, then each part by the keys */
+    int dirs_num = 0;
+    if (dirs_first == 1)
+    {
+        for (int i = 0; i < list->num; i++)
+            if (list->entries[i].type == DT_DIR)
+                tmp[dirs_num++] = list->entries[i];
+        for (int i = 0, j = dirs_num; i < list->num; i++)
+            if (list->entries[i].type != DT_DIR)
+                tmp[j++] = list->entries[i];
+        memcpy(list->entries, tmp, list->num * sizeof(entry));
+    }
+
+    int parts[2][2] = { { 0, dirs_num }, { dirs_num, list->num - dirs_num } };
+    for (int part = 0; part < 2; part++)
+    {
+        entry *entries = list->entries + parts[part][0];
+        int num = parts[part][1];
+        if (is_sorted_by_value() == 1)
+        {
+            qsort_r(entries, num, sizeof(entry), compare_elements, list->names);
+            continue; // The keys do not decide, radix sort cannot be used
+        }
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (num < SORT_PARALLEL || cpus < 2)
+        {
+            radix_sort(entries, tmp, num, 0, list->names);
+            continue;
+        }
+
+        /* The buckets of the first byte are sorted by several threads */
+        radix_job job = { .entries = entries, .tmp = tmp, .names = list->names };
+        radix_split(entries, tmp, num, 0, list->names, job.starts);
+        pthread_t threads[16];
+        int threads_num = 0;
+        sigset_t old_set;
+        pthread_sigmask(SIG_BLOCK, &signal_set, &old_set);
+        for (int i = 1; i < cpus && i < 16; i++)
+            if (pthread_create(&threads[threads_num], NULL, radix_worker, &job) == 0)
+                threads_num++;
+        pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+        radix_worker(&job);
+        for (int i = 0; i < threads_num; i++)
+            pthread_join(threads[i], NULL);
+    }
+    free(tmp);
+    count_time(STATS_SORT, start);
+}
+
+void radix_sort(entry *entries, entry *tmp, int num, int depth, char *names)
+{
+    /* MSD radix sort by the bytes of the keys */
+    if (num < SORT_SMALL)
+    {
+        insertion_sort(entries, num, names);
+        return;
+    }
+    int starts[258];
+    radix_split(entries, tmp, num, depth, names, starts);
+
+    /* The first bucket holds the keys that have ended */
+    if (starts[1] > 1)
+        qsort_r(entries, starts[1], sizeof(entry), compare_elements, names);
+    for (int i = 1; i < 257; i++)
+        if (starts[i + 1] - starts[i] > 1)
+            radix_sort(entries + starts[i], tmp + starts[i], starts[i + 1] - starts[i], depth + 1, names);
+}
+
+void radix_split(entry *entries, entry *tmp, int num, int depth, char *names, int *starts)
+{
+    /* Distribute the entries by the byte of the key at the depth */
+    int counts[257] = { 0 };
+    for (int i = 0; i < num; i++)
+    {
+        entry *e = &entries[i];
+        int byte = (depth < e->key_len) ? (unsigned char) names[e->name_off + e->name_len + 1 + depth] + 1 : 0;
+        counts[byte]++;
+    }
+    starts[0] = 0;
+    for (int i = 0; i < 257; i++)
+        starts[i + 1] = starts[i] + counts[i];
+
+    int pos[257];
+    memcpy(pos, starts, sizeof(pos));
+    for (int i = 0; i < num; i++)
+    {
+        entry *e = &entries[i];
+        int byte = (depth < e->key_len) ? (unsigned char) names[e->name_off + e->name_len + 1 + depth] + 1 : 0;
+        tmp[pos[byte]++] = *e;
+    }
+    memcpy(entries, tmp, num * sizeof(entry));
+}
+
+void *radix_worker(void *arg)
+{
+    radix_job *job = arg;
+    int bucket;
+    while ((bucket = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < 257)
+    {
+        int start = job->starts[bucket];
+        int num = job->starts[bucket + 1] - start;
+        if (num < 2)
+            continue;
+        if (bucket == 0)
+            qsort_r(job->entries, num, sizeof(entry), compare_elements, job->names);
+        else
+            radix_sort(job->entries + start, job->tmp + start, num, 1, job->names);
+    }
+    return NULL;
+}
+
+void insertion_sort(entry *entries, int num, char *names)
+{
+    for (int i = 1; i < num; i++)
+    {
+        entry e = entries[i];
+        int j = i;
+        for (; j > 0 && compare_elements(&entries[j - 1], &e, names) > 0; j--)
+            entries[j] = entries[j - 1];
+        entries[j] = e;
+    }
+}
+
+void filter_listing(pane *pane)
+{
+    int64_t start = start_timer();
+    pane->list.view_num = 0;
+    pane->dirs_num = 0;
+    pane->files_num = 0;
+    for (int i = 0; i < pane->list.num; i++)
+    {
+        if (hide_flag == 0 && entry_name(&pane->list, i)[0] == '.')
+            continue;
+        pane->list.view[pane->list.view_num++] = i;
+        if (pane->list.entries[i].type == DT_DIR && dirs_first == 1)
+            pane->dirs_num += 1; // Otherwise the directories are among the files
+        else
+            pane->files_num += 1;
+    }
+    pane->list.view_hide_flag = hide_flag;
+
+    /* The search index and the matches are made again when they are needed */
+    free(pane->list.folded);
+    free(pane->list.folded_starts);
+    pane->list.folded = NULL;
+    pane->list.folded_starts = NULL;
+    pane->matches_ok = 0;
+    count_time(STATS_LIST, start);
+}
+
+char *get_name(pane *pane, int index)
+{
+    return entry_name(&pane->list, pane->list.view[index]);
+}
+
+char *entry_name(listing *list, int index)
+{
+    return list->names + list->entries[index].name_off;
+}
+
+void free_listing(listing *list)
+{
+    free(list->names); // All names at once
+    free(list->entries);
+    free(list->view);
+    free(list->folded);
+    free(list->folded_starts);
+    memset(list, 0, sizeof(listing));
+}
+
+int load_snapshot(pane *pane)
+{
+    /* The listing saved when the directory was last read, if the directory has not changed since */
+    int64_t start = start_timer();
+    char *path = get_snapshot_path(pane->path);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    struct stat st;
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(snapshot_header))
+    {
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    futimens(fd, NULL); // Recently used, it is pruned last
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    /* The snapshots are replaced by rename, a mapped file is never truncated */
+    snapshot_header *header = (snapshot_header *) map;
+    size_t entries_off = (sizeof(snapshot_header) + header->path_len + 7) & ~(size_t) 7;
+    size_t names_off = entries_off + (size_t) header->num * sizeof(entry);
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, 8) != 0 || header->dev != pane->list_st.st_dev ||
+        header->ino != pane->list_st.st_ino || header->mtime_sec != pane->list_st.st_mtim.tv_sec ||
+        header->mtime_nsec != pane->list_st.st_mtim.tv_nsec || header->order != get_snapshot_order() ||
+        header->locale != hash_path(setlocale(LC_COLLATE, NULL)) || header->path_len != strlen(pane->path) || (off_t) (names_off + header->names_len) != st.st_size ||
+        memcmp(map + sizeof(snapshot_header), pane->path, header->path_len) != 0 || header->num == 0)
+    {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    /* Each name and its sort key, with their '\0', must be within the names */
+    entry *entries = (entry *) (map + entries_off);
+    const char *names = map + names_off;
+    for (uint32_t i = 0; i < header->num; i++)
+    {
+        uint64_t end = (uint64_t) entries[i].name_off + entries[i].name_len + entries[i].key_len + 2;
+        if (end > header->names_len || names[entries[i].name_off + entries[i].name_len] != '\0' ||
+            names[end - 1] != '\0')
+        {
+            munmap(map, st.st_size);
+            return -1;
+        }
+    }
+
+    /* Copied, so the listing can change with the directory */
+    listing *list = &pane->list;
+    list->num = header->num;
+    list->cap = header->num;
+    list->names_len = header->names_len;
+    list->names_cap = header->names_len + 1;
+    list->names_used = header->names_len;
+    list->entries = malloc(list->cap * sizeof(entry));
+    list->view = malloc(list->cap * sizeof(int));
+    list->names = malloc(list->names_cap);
+    count_stats(&frame_stats.allocs, 3);
+    if (list->entries == NULL || list->view == NULL || list->names == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(list->entries, map + entries_off, list->num * sizeof(entry));
+    memcpy(list->names, map + names_off, list->names_len);
+    munmap(map, st.st_size);
+    count_time(STATS_LIST, start);
+    return 0;
+}
+
+void save_snapshot(const char *dir, struct stat *st, listing *list)
+{
+    /* Small directories are read fast enough */
+    if (list->num < SNAPSHOT_MIN || st->st_ino == 0)
+        return;
+    snapshot_header header = { .dev = st->st_dev, .ino = st->st_ino, .mtime_sec = st->st_mtim.tv_sec,
+                               .mtime_nsec = st->st_mtim.tv_nsec, .order = get_snapshot_order(),
+                               .locale = hash_path(setlocale(LC_COLLATE, NULL)),
+                               .num = list->num, .path_len = strlen(dir), .names_len = list->names_len };
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    char *path = get_snapshot_path(dir);
+    int alloc_size = snprintf(NULL, 0, "%s.XXXXXX", path);
+    char *tmp_path = malloc(alloc_size + 1);
+    if (tmp_path == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(tmp_path, alloc_size + 1, "%s.XXXXXX", path);
+
+    /* Written aside and renamed, other instances may have the old one mapped */
+    int fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd != -1)
+    {
+        char pad[8] = { 0 };
+        size_t pad_len = ((sizeof(header) + header.path_len + 7) & ~(size_t) 7) - sizeof(header) - header.path_len;
+        struct iovec iov[5] = { { &header, sizeof(header) }, { (void *) dir, header.path_len }, { pad, pad_len },
+                                { list->entries, list->num * sizeof(entry) }, { list->names, list->names_len } };
+        size_t total = 0;
+        for (int i = 0; i < 5; i++)
+            total += iov[i].iov_len;
+        ssize_t len = writev(fd, iov, 5); // A short write leaves a snapshot that is never valid
+        close(fd);
+        if (len != (ssize_t) total || rename(tmp_path, path) == -1)
+            unlink(tmp_path);
+    }
+    free(tmp_path);
+    free(path);
+    prune_snapshots();
+}
+
+void prune_snapshots()
+{
+    /* The least recently used snapshots are removed */
+    for (;;)
+    {
+        DIR *dir = opendir(snapshots_path);
+        if (dir == NULL)
+            return;
+        struct dirent *pDirent;
+        struct stat st;
+        char oldest[NAME_MAX + 1] = "";
+        struct timespec oldest_time = { 0 };
+        int num = 0;
+        while ((pDirent = readdir(dir)) != NULL)
+        {
+            if (pDirent->d_name[0] == '.' || fstatat(dirfd(dir), pDirent->d_name, &st, 0) == -1)
+                continue;
+            num++;
+            if (oldest[0] == '\0' || st.st_mtim.tv_sec < oldest_time.tv_sec ||
+                (st.st_mtim.tv_sec == oldest_time.tv_sec && st.st_mtim.tv_nsec < oldest_time.tv_nsec))
+            {
+                snprintf(oldest, sizeof(oldest), "%s", pDirent->d_name);
+                oldest_time = st.st_mtim;
+            }
+        }
+        if (num > SNAPSHOT_FILES)
+            unlinkat(dirfd(dir), oldest, 0);
+        closedir(dir);
+        if (num <= SNAPSHOT_FILES + 1)
+            return;
+    }
+}
+
+char *get_snapshot_path(const char *dir)
+{
+    int alloc_size = snprintf(NULL, 0, "%s/%08x", snapshots_path, hash_path(dir));
+    char *path = malloc(alloc_size + 1);
+    if (path == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(path, alloc_size + 1, "%s/%08x", snapshots_path, hash_path(dir));
+    return path;
+}
+
+uint32_t get_snapshot_order()
+{
+    /* The keys depend on the sort mode, the collation is checked apart */
+    return sort_mode | dirs_first << 8 | usage_mode << 9 | SORT_LOCALE << 10;
+}
+
+void start_loader(pane *pane, int stream)
+{
+    loader *load = calloc(1, sizeof(loader));
+    if (load == NULL || (load->path = strdup(pane->path)) == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    load->stream = stream;
+    pane->load = load;
+    pthread_mutex_lock(&load_lock);
+    load->next = load_queue;
+    load_queue = load;
+    load_queued++;
+    pthread_cond_signal(&load_cond);
+
+    /* The workers are kept, each one keeps its buffers for reading directories */
+    if (load_idle < load_queued)
+    {
+        sigset_t old_set;
+        pthread_t thread;
+        pthread_sigmask(SIG_BLOCK, &signal_set, &old_set);
+        if (pthread_create(&thread, NULL, run_loader, NULL) == 0)
+        {
+            pthread_detach(thread);
+            load_idle++; // Until it takes a directory
+        }
+        pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    }
+    pthread_mutex_unlock(&load_lock);
+}
+
+void wait_loader(pane *pane, int ms)
+{
+    /* A directory read in time is shown whole, as if it had been read by the UI */
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += ms * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    pthread_mutex_lock(&load_lock);
+    while (__atomic_load_n(&pane->load->state, __ATOMIC_ACQUIRE) != LOAD_DONE &&
+           pthread_cond_timedwait(&load_done, &load_lock, &deadline) == 0)
+        ;
+    pthread_mutex_unlock(&load_lock);
+    if (__atomic_load_n(&pane->load->state, __ATOMIC_ACQUIRE) == LOAD_DONE)
+        finish_loader(pane);
+    else
+        take_entries(pane);
+}
+
+void stop_loader(pane *pane)
+{
+    loader *load = pane->load;
+    if (load == NULL)
+        return;
+    pane->load = NULL;
+    __atomic_store_n(&load->cancel, 1, __ATOMIC_RELAXED);
+    if (__atomic_exchange_n(&load->state, LOAD_CANCELLED, __ATOMIC_ACQ_REL) == LOAD_DONE)
+        free_loader(load);
+}
+
+void finish_loader(pane *pane)
+{
+    loader *load = pane->load;
+    if (load->stream == 1)
+        take_entries(pane); // The last ones
+    pane->load = NULL;
+    int error = load->error;
+
+    /* The listing read in the background replaces the one shown from the snapshot */
+    if (load->stream == 0 && error == 0)
+    {
+        char *selected = NULL;
+        int num = pane->dirs_num + pane->files_num;
+        if (pane->list.view_hide_flag == hide_flag && num != 0 &&
+            (selected = strdup(get_name(pane, pane->top_index + pane->select - 1))) == NULL)
+        {
+            endwin();
+            perror("memory allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        free_listing(&pane->list);
+        pane->list = load->list;
+        pane->list_st = load->st;
+        memset(&load->list, 0, sizeof(listing));
+        filter_listing(pane);
+        if (selected != NULL)
+            go_to_name(pane, selected);
+        free(selected);
+        pane->usage_generation = -1; // The totals are taken again
+        pane->redraw = 1;
+    }
+    int stream = load->stream;
+    free_loader(load);
+    if (error != 0)
+        return; // The snapshot is kept, an unreadable directory stays empty
+
+    /* The changes made while the directory was read are not in the listing */
+    struct stat st;
+    if (stat(pane->path, &st) == 0 && (st.st_mtim.tv_sec != pane->list_st.st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != pane->list_st.st_mtim.tv_nsec))
+        start_loader(pane, 0);
+    else if (SNAPSHOTS == 1 && stream == 1)
+        save_snapshot(pane->path, &pane->list_st, &pane->list);
+}
+
+void free_loader(loader *load)
+{
+    free_listing(&load->list);
+    free_listing(&load->batch);
+    free(load->path);
+    free(load);
+}
+
+void *run_loader(void *arg)
+{
+    (void) arg;
+
+    /* The kernel stats the files of a batch on its workers, with one CPU that is only overhead */
+    if (sysconf(_SC_NPROCESSORS_ONLN) > 1)
+        init_ring(&stat_ring, STAT_BATCH);
+    for (;;)
+    {
+        pthread_mutex_lock(&load_lock);
+        while (load_queue == NULL)
+            pthread_cond_wait(&load_cond, &load_lock);
+        loader *load = load_queue;
+        load_queue = load->next;
+        load_queued--;
+        load_idle--;
+        pthread_mutex_unlock(&load_lock);
+
+        if (__atomic_load_n(&load->cancel, __ATOMIC_RELAXED) == 0)
+        {
+            /* While streamed, the listing only gathers the entries until they are published */
+            if (stat(load->path, &load->st) == -1 ||
+                read_listing(&load->list, load->path, &load->cancel, (load->stream == 1) ? load : NULL) == -1)
+                load->error = errno;
+            else if (load->stream == 0 && __atomic_load_n(&load->cancel, __ATOMIC_RELAXED) == 0)
+                sort_listing(&load->list);
+        }
+        int state = __atomic_exchange_n(&load->state, LOAD_DONE, __ATOMIC_ACQ_REL);
+        pthread_mutex_lock(&load_lock);
+        pthread_cond_broadcast(&load_done);
+        load_idle++;
+        pthread_mutex_unlock(&load_lock);
+        if (state == LOAD_CANCELLED)
+            free_loader(load);
+        else if (write(meta_pipe[1], "", 1) == -1 && errno != EAGAIN)
+            continue; // The UI is woken up by the bytes already in the pipe
+    }
+    return NULL;
+}
+
+void publish_entries(loader *load, listing *list, int dirfd, int last)
+{
+    /* The entries gather until the UI has taken the last batch, at most a few times a second */
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    if (last == 0 && (list->num == 0 || ms - load->published < LOAD_REFRESH))
+        return;
+    pthread_mutex_lock(&load_lock);
+    int taken = load->batch.num == 0;
+    pthread_mutex_unlock(&load_lock);
+    if (last == 0 && taken == 0)
+        return;
+    if (is_sorted_by_value() == 1)
+        read_metadata(list, dirfd, &stat_ring);
+    if (__atomic_load_n(&load->cancel, __ATOMIC_RELAXED) == 0)
+        sort_listing(list); // By the worker, the UI only merges
+    load->published = ms;
+
+    pthread_mutex_lock(&load_lock);
+    if (load->batch.num == 0)
+    {
+        free_listing(&load->batch);
+        load->batch = *list;
+        load->batch_split = list->num;
+        memset(list, 0, sizeof(listing));
+    }
+    else if (list->num != 0)
+    {
+        /* The last entries follow the batch the UI has not taken yet */
+        listing *batch = &load->batch;
+        size_t size = batch->names_len + list->names_len;
+        entry *entries = realloc(batch->entries, (batch->num + list->num) * sizeof(entry));
+        char *names = realloc(batch->names, size + 1);
+        count_stats(&frame_stats.allocs, 2);
+        if (entries == NULL || names == NULL)
+        {
+            endwin();
+            perror("memory allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(names + batch->names_len, list->names, list->names_len);
+        for (int i = 0; i < list->num; i++)
+        {
+            entries[batch->num + i] = list->entries[i];
+            entries[batch->num + i].name_off += batch->names_len;
+        }
+        batch->entries = entries;
+        batch->names = names;
+        batch->names_cap = size + 1;
+        batch->names_len = size;
+        batch->names_used += list->names_used;
+        batch->cap = batch->num + list->num;
+        batch->num += list->num;
+        free_listing(list);
+    }
+    pthread_mutex_unlock(&load_lock);
+    if (write(meta_pipe[1], "", 1) == -1 && errno != EAGAIN)
+        return; // The UI is woken up by the bytes already in the pipe
+}
+
+void take_entries(pane *pane)
+{
+    loader *load = pane->load;
+    pthread_mutex_lock(&load_lock);
+    listing batch = load->batch;
+    int split = load->batch_split;
+    memset(&load->batch, 0, sizeof(listing));
+    pthread_mutex_unlock(&load_lock);
+    if (batch.num == 0)
+    {
+        free_listing(&batch);
+        return;
+    }
+
+    /* The cursor stays on its file, unless it has not left the first one */
+    char *selected = NULL;
+    int num = pane->dirs_num + pane->files_num;
+    if (pane->list.view_hide_flag == hide_flag && num != 0 && pane->top_index + pane->select > 1 &&
+        (selected = strdup(get_name(pane, pane->top_index + pane->select - 1))) == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* The names are appended to the arena, the sorted runs are merged into the entries */
+    listing *list = &pane->list;
+    size_t base = list->names_len;
+    if (base + batch.names_len > UINT32_MAX)
+    {
+        endwin();
+        fprintf(stderr, "too many files in the directory\n");
+        exit(EXIT_FAILURE);
+    }
+    if (base + batch.names_len > list->names_cap)
+    {
+        list->names_cap = base + batch.names_len + list->names_cap / 2;
+        list->names = realloc(list->names, list->names_cap);
+        count_stats(&frame_stats.allocs, 1);
+        if (list->names == NULL)
+        {
+            endwin();
+            perror("memory allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(list->names + base, batch.names, batch.names_len);
+    list->names_len += batch.names_len;
+    list->names_used += batch.names_used;
+    for (int i = 0; i < batch.num; i++)
+        batch.entries[i].name_off += base;
+    merge_entries(list, batch.entries, split);
+    merge_entries(list, batch.entries + split, batch.num - split);
+    free_listing(&batch);
+
+    filter_listing(pane);
+    if (selected != NULL)
+        go_to_name(pane, selected);
+    free(selected);
+    pane->usage_generation = -1;
+    pane->redraw = 1;
+}
+
+void merge_entries(listing *list, entry *run, int num)
+{
+    if (num == 0)
+        return;
+    int64_t start = start_timer();
+    entry *entries = malloc((list->num + num) * sizeof(entry));
+    int *view = malloc((list->num + num) * sizeof(int));
+    count_stats(&frame_stats.allocs, 2);
+    if (entries == NULL || view == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    int i = 0;
+    int j = 0;
+    int k = 0;
+    while (i < list->num && j < num)
+    {
+        int ret = compare_elements(&list->entries[i], &run[j], list->names);
+        if (ret == 0)
+        {
+            /* Already inserted from inotify */
+            list->names_used -= run[j].name_len + run[j].key_len + 2;
+            j++;
+            continue;
+        }
+        entries[k++] = (ret < 0) ? list->entries[i++] : run[j++];
+    }
+    memcpy(entries + k, list->entries + i, (list->num - i) * sizeof(entry));
+    k += list->num - i;
+    memcpy(entries + k, run + j, (num - j) * sizeof(entry));
+    k += num - j;
+    free(list->entries);
+    free(list->view);
+    list->entries = entries;
+    list->view = view;
+    list->cap = list->num + num;
+    list->num = k;
+    count_time(STATS_SORT, start);
+}
+
+void go_to_name(pane *pane, const char *name)
+{
+    /* The cursor follows the file, the list scrolls only if the file has left the screen */
+    for (int i = 0; i < pane->list.view_num; i++)
+    {
+        if (strcmp(get_name(pane, i), name) != 0)
+            continue;
+        if (i >= pane->top_index && i < pane->top_index + termsize_y - 2)
+            pane->select = i - pane->top_index + 1;
+        else
+            go_to_index(pane, i);
+        return;
+    }
+}
+
+void make_windows()
+{
+    /* The windows are kept until the terminal is resized */
+    if (left_pane.win == NULL || getmaxy(left_pane.win) != termsize_y || getmaxx(status_bar) != termsize_x)
+    {
+        if (left_pane.win != NULL)
+        {
+            delwin(left_pane.win);
+            delwin(right_pane.win);
+            delwin(status_bar);
+        }
+        if (stats_win != NULL)
+        {
+            delwin(stats_win); // Made again in its new place
+            stats_win = NULL;
+        }
+        left_pane.win  = create_window(termsize_y, termsize_x / 2 + 1, 0, 0);
+        right_pane.win = create_window(termsize_y, termsize_x / 2 + 1, 0, termsize_x / 2);
+        status_bar = create_window(2, termsize_x, termsize_y - 1, 0);
+        keypad (left_pane.win, TRUE);
+        keypad (right_pane.win, TRUE);
+        wsetscrreg(left_pane.win, 1, termsize_y - 2); // The lines of the files
+        wsetscrreg(right_pane.win, 1, termsize_y - 2);
+
+        left_pane.rows = realloc(left_pane.rows, termsize_y * sizeof(int));
+        right_pane.rows = realloc(right_pane.rows, termsize_y * sizeof(int));
+        if (left_pane.rows == NULL || right_pane.rows == NULL)
+        {
+            endwin();
+            perror("memory allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        left_pane.redraw = 1;
+        right_pane.redraw = 1;
+    }
+    sigprocmask(SIG_UNBLOCK, &signal_set, NULL); // Unblock SIGWINCH
+}
+
+void refresh_windows()
+{
+    wnoutrefresh(left_pane.win);
+    wnoutrefresh(right_pane.win);
+    wnoutrefresh(status_bar);
+    if (stats_win != NULL)
+        wnoutrefresh(stats_win); // Over the panes
+    doupdate();
+}
+
+WINDOW *create_window(int height, int width, int starty, int startx)
+{
+    WINDOW *win;
+    win = newwin(height, width, starty, startx);
+    return win;
+}
+
+void close_window(WINDOW *win)
+{
+    /* The panes under the window are sent to the terminal again */
+    delwin(win);
+    touchwin(left_pane.win);
+    touchwin(right_pane.win);
+}
+
+void restore_indexes(pane *pane)
+{
+    /* The parent may not be read yet, the cursor is put on it when it comes */
+    if (pane->load != NULL && pane->load->stream == 1)
+    {
+        free(pane->jump_name);
+        if ((pane->jump_name = strdup(pane->parent_dirname)) == NULL)
+        {
+            endwin();
+            perror("memory allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        back_flag = 0;
+        return;
+    }
+
+    /* The parent is among the directories, or among all files if they are not first */
+    int num = (dirs_first == 1) ? pane->dirs_num : pane->files_num;
+    for (int i = 0; i < num; i++)
+    {
+        if (strcmp(get_name(pane, i), pane->parent_dirname) == 0)
+        {
+            if (termsize_y > num)
+            {
+                pane->top_index = 0;
+                pane->select = i + 1;
+                break;
+            }
+            else if (i < num - (termsize_y - 2))
+            {
+                pane->top_index = i;
+                pane->select = 1;
+                break;
+            }
+            else
+            {
+                pane->top_index = num - (termsize_y - 2);
+                pane->select = termsize_y - 1 - (num - i);
+                break;
+            }
+        }
+    }
+    back_flag = 0;
+}
+
+void print_files(pane *pane)
+{
+    /* A scroll by one line moves the drawn lines, only the new one is printed */
+    int shift = pane->top_index - pane->drawn_top;
+    if (pane->redraw == 0 && (shift == 1 || shift == -1))
+    {
+        scrollok(pane->win, TRUE);
+        wscrl(pane->win, shift);
+        scrollok(pane->win, FALSE);
+        touchline((pane == &left_pane) ? right_pane.win : left_pane.win, 1, termsize_y - 2);
+        if (shift == 1)
+        {
+            memmove(&pane->rows[1], &pane->rows[2], (termsize_y - 3) * sizeof(int));
+            pane->rows[termsize_y - 2] = -2;
+        }
+        else
+        {
+            memmove(&pane->rows[2], &pane->rows[1], (termsize_y - 3) * sizeof(int));
+            pane->rows[1] = -2;
+        }
+    }
+    else if (shift != 0)
+        pane->redraw = 1;
+    if (pane->redraw == 1)
+    {
+        for (int i = 0; i < termsize_y; i++)
+            pane->rows[i] = -2; // Unknown, so it is printed
+    }
+
+    /* Print only the lines that look different from the drawn ones */
+    int num = pane->dirs_num + pane->files_num;
+    for (int line_pos = 1; line_pos < termsize_y - 1; line_pos++)
+    {
+        int index = pane->top_index + line_pos - 1;
+        if (index >= num)
+            index = -1;
+        int state = get_row_state(pane, line_pos, index);
+        if (state != pane->rows[line_pos])
+        {
+            pane->rows[line_pos] = state;
+            print_row(pane, line_pos, index);
+        }
+    }
+    pane->drawn_top = pane->top_index;
+    pane->drawn_changes = clipboard_set.changes;
+    pane->redraw = 0;
+}
+
+int get_row_state(pane *pane, int line_pos, int index)
+{
+    /* The index of the file, whether it is selected and on the clipboard */
+    if (index == -1)
+        return -1;
+    int state = index * 4;
+    if (line_pos == pane->select)
+        state += 2;
+
+    /* The path is made only for a file that was not on the line, or after the clipboard has changed */
+    int drawn = pane->rows[line_pos];
+    if (drawn >= 0 && drawn / 4 == index && pane->drawn_changes == clipboard_set.changes)
+        state += drawn & 1;
+    else if (clipboard_num != 0)
+    {
+        char path[PATH_MAX + NAME_MAX + 2];
+        snprintf(path, sizeof(path), "%s/%s", (pane->path[1] == '\0') ? "" : pane->path, get_name(pane, index));
+        if (exist_clipboard(path) == 0)
+            state += 1;
+    }
+    return state;
+}
+
+void print_row(pane *pane, int line_pos, int index)
+{
+    /* The panes overlap by one column, the other one has to be sent again */
+    touchline((pane == &left_pane) ? right_pane.win : left_pane.win, line_pos, 1);
+    if (index == -1)
+    {
+        wmove(pane->win, line_pos, 0);
+        wclrtoeol(pane->win);
+        return;
+    }
+
+    char *name = get_name(pane, index);
+    int color = (pane->list.entries[pane->list.view[index]].type == DT_DIR) ? 1 : 0;
+    file_info info;
+    if (color == 0 && mime_colors == 1 && get_meta(pane, index, &info) == 1)
+        color = get_mime_color(info.mime);
+    if (color == 1)
+        wattron(pane->win, A_BOLD);
+    if (line_pos == pane->select)
+    {
+        wattron(pane->win, A_STANDOUT); // Highlighting
+        free(pane->select_path);
+        pane->select_path = get_select_path(index, pane);
+    }
+
+    /* selecting files on the clipboard */
+    if ((pane->rows[line_pos] & 1) != 0)
+    {
+        wattron(pane->win, COLOR_PAIR(2));
+        print_line(pane->win, line_pos, name);
+        wmove(pane->win, line_pos, 0);
+        wprintw(pane->win, ">");
+        wattroff(pane->win, COLOR_PAIR(2));
+    }
+    else
+    {
+        wattron(pane->win, COLOR_PAIR(color));
+        print_line(pane->win, line_pos, name);
+        wattroff(pane->win, COLOR_PAIR(color));
+    }
+    int last = getcury(pane->win);
+    if (usage_mode == 1)
+        print_usage(pane, line_pos, index);
+    else if (details == 1)
+        print_details(pane, line_pos, index);
+    wattroff(pane->win, A_STANDOUT);
+    wattroff(pane->win, A_BOLD);
+
+    /* A long name continues on the next lines, they are printed again */
+    for (int i = line_pos + 1; i < last && i < termsize_y; i++)
+        pane->rows[i] = -2;
+}
+
+char *get_select_path(int index, pane *pane)
+{
+    char *name = get_name(pane, index);
+    int alloc_size = snprintf(NULL, 0, "%s/%s", pane->path, name);
+    char *path = malloc(alloc_size + 1);
+    if (path == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pane->path[1] == '\0') // For root dir
+        snprintf(path, alloc_size + 1, "%s%s", pane->path, name);
+    else
+        snprintf(path, alloc_size + 1, "%s/%s", pane->path, name);
+    return path;
+}
+
+void print_line(WINDOW *window, int pos, char *str)
+{
+    wmove(window, pos, 0);
+    wclrtoeol(window); // Pre-erase the string for too long file names
+    wmove(window, pos, 2);
+    wprintw(window, "%s\n", str);
+}
+
+void go_down(pane *pane)
+{
+    int num = pane->dirs_num + pane->files_num;
+    pane->select++;
+    if (pane->select > num)
+        pane->select = num;
+
+    /* Scrolling */
+    if (pane->select > termsize_y - 2)
+    {
+        if (num - pane->top_index > termsize_y - 2)
+            pane->top_index++;
+        pane->select--;
+    }
+
+}
+
+void go_up(pane *pane)
+{
+    pane->select--;
+
+    /* Scrolling */
+    if (pane->select < 1)
     {
         if (pane->top_index > 0)
             pane->top_index--;
         pane->select = 1;
-        wclear(pane->win);
     }
 }
 
-void go_previous(pane *pane)
+void go_previous(pane *pane)
+{
+    free(pane->parent_dirname);
+    char *ptr = strrchr(pane->path, '/');
+    int alloc_size = snprintf(NULL, 0, "%s", ptr);
+    pane->parent_dirname = malloc(alloc_size + 1);
+    if (pane->parent_dirname == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(pane->parent_dirname, alloc_size + 1, "%s", ptr + 1);
+
+    pane->path[strrchr(pane->path, '/') - pane->path] = '\0';
+    if (pane->path[0] == '\0') // For root dir
+    {
+        pane->path[0] = '/';
+        pane->path[1] = '\0';
+    }
+
+    pane->list_dirty = 1;
+    back_flag = 1;
+}
+
+int is_dir(const char *path)
+{
+    struct stat st;
+    stat(path, &st);
+    return S_ISDIR(st.st_mode); // Returns non-zero if the file is a directory
+}
+
+void open_dir(pane *pane)
+{
+    free(pane->path);
+    int alloc_size = snprintf(NULL, 0, "%s", pane->select_path);
+    pane->path = malloc(alloc_size + 1);
+    if (pane->path == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(pane->path, alloc_size + 1, "%s", pane->select_path);
+
+    pane->list_dirty = 1;
+    pane->select = 1;
+    pane->top_index = 0;
+}
+
+void open_file(pane *pane)
+{
+    /* The type is cached with the size and time of the file, a changed file is read again */
+    char mime[80] = "";
+    struct stat st;
+    int ret = lstat(pane->select_path, &st);
+    file_info *m;
+    pthread_mutex_lock(&meta_lock);
+    if (ret == 0 && (m = find_meta(pane->list_st.st_dev, st.st_ino)) != NULL && m->ready == 1 &&
+        m->size == st.st_size && m->mtime.tv_sec == st.st_mtim.tv_sec && m->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        memcpy(mime, m->mime, sizeof(mime));
+    pthread_mutex_unlock(&meta_lock);
+    if (mime[0] == '\0')
+    {
+        const char *type = get_mime_type(&magic_cookie, pane->select_path);
+        if (type != NULL)
+            snprintf(mime, sizeof(mime), "%s", type);
+        pthread_mutex_lock(&meta_lock);
+        if (ret == 0 && (m = find_meta(pane->list_st.st_dev, st.st_ino)) != NULL && m->ready == 1 &&
+            m->size == st.st_size && m->mtime.tv_sec == st.st_mtim.tv_sec && m->mtime.tv_nsec == st.st_mtim.tv_nsec)
+            memcpy(m->mime, mime, sizeof(mime));
+        pthread_mutex_unlock(&meta_lock);
+    }
+
+    const char *filetype = (mime[0] != '\0') ? mime : NULL;
+    if (filetype != NULL)
+    {
+        if (strstr(filetype, "text/")     != NULL ||
+            strstr(filetype, "empty")     != NULL ||
+            strstr(filetype, "sharedlib") != NULL ||
+            strstr(filetype, "/zip")      != NULL ||
+            strstr(filetype, "symlink")   != NULL ||
+            strstr(filetype, "octet")     != NULL)
+        {
+            /* Open a file in default text editor */
+            endwin();
+            sigprocmask(SIG_BLOCK, &signal_set, NULL); // block SIGWINCH
+            char *argv[] = { editor, pane->select_path, (char *)0 };
+            pid_t pid = fork_exec(argv[0], argv);
+            int status;
+            waitpid(pid, &status, 0);
+            invalidate_listings(); // The editor could have saved new files
+        }
+        else
+        {
+            /* Open a file in the user's preferred application */
+            char *argv[] = { "xdg-open", pane->select_path, (char *)0 };
+            fork_exec(argv[0], argv);
+        }
+    }
+    else
+        perror("an magic_error occurred:\n");
+}
+
+pid_t fork_exec(char *cmd, char **argv)
+{
+    pid_t pid;
+    int64_t start = start_timer();
+    pid = fork();
+    if (pid == -1)
+    {
+        endwin();
+        perror("fork error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        int fd = open("/dev/null", O_WRONLY);
+        dup2(fd, STDERR_FILENO);
+        close(fd); // Stderr now write to /dev/null
+        execvp(cmd, argv);
+        perror("EXEC:\n");
+        exit(EXIT_FAILURE);
+    }
+    count_stats(&frame_stats.syscalls, 1);
+    count_time(STATS_FILES, start);
+    return pid;
+}
+
+void highlight_active_pane(int y, int x)
+{
+    wattron(status_bar, COLOR_PAIR(2));
+    mvwhline(status_bar, y, x, ACS_HLINE, termsize_x / 2);
+    wattroff(status_bar, COLOR_PAIR(2));
+}
+
+void print_status(pane *pane)
+{
+    int num = pane->dirs_num + pane->files_num;
+    int file_number = 0;
+    if (num != 0)
+        file_number = pane->top_index + pane->select;
+
+    /* A directory still read shows how far it has come */
+    char loading[48] = "";
+    if (pane->load != NULL && pane->load->stream == 1)
+        snprintf(loading, sizeof(loading), "  loading %d entries...",
+                 __atomic_load_n(&pane->load->loaded, __ATOMIC_RELAXED));
+
+    /* The size comes from the cache, the file is not read on every frame */
+    file_info info;
+    if (num != 0 && usage_mode == 1)
+    {
+        char buf[16];
+        char total[16];
+        get_human_filesize(pane->list.entries[pane->list.view[file_number - 1]].value, buf);
+        get_human_filesize(pane->usage_total, total);
+        wmove(status_bar, 1, 0);
+        wprintw(status_bar, "[%02d/%02d]  [*%d]%s  %s of %s%s  %s", file_number, num, clipboard_num, loading,
+                buf, total, (pane->usage_scanning == 1) ? " ..." : "", pane->select_path);
+    }
+    else if (num != 0 && pane->list.entries[pane->list.view[file_number - 1]].type != DT_DIR &&
+        get_meta(pane, file_number - 1, &info) == 1 && info.mode != 0)
+    {
+        char buf[16];
+        char *human_size = get_human_filesize(info.size, buf);
+        wmove(status_bar, 1, 0);
+        wprintw(status_bar, "[%02d/%02d]  [*%d]%s  %s  %s", file_number, num, clipboard_num, loading,
+                human_size, pane->select_path);
+    }
+    else
+    {
+        wmove(status_bar, 1, 0);
+        wprintw(status_bar, "[%02d/%02d]  [*%d]%s  %s", file_number, num, clipboard_num, loading,
+                pane->select_path);
+    }
+    print_jobs();
+}
+
+void print_notification(char *str)
+{
+    wattron(status_bar, COLOR_PAIR(2));
+    wattron(status_bar, A_BOLD);
+    print_line(status_bar, 1, str);
+    wattroff(status_bar, COLOR_PAIR(2));
+    wattroff(status_bar, A_BOLD);
+    wrefresh(status_bar);
+    usleep(1000000);
+}
+
+char *get_human_filesize(double size, char *buf)
+{
+    const char *units[] = {"B", "kB", "MB", "GB", "TB", "PB"};
+    int i = 0;
+    while (size > 1024)
+    {
+        size /= 1024;
+        i++;
+    }
+    sprintf(buf, "%.*f %s", i, size, units[i]);
+    return buf;
+}
+
+int get_meta(pane *pane, int index, file_info *info)
+{
+    /* Copies the details of the file if they are read, otherwise asks the workers for them */
+    entry *e = &pane->list.entries[pane->list.view[index]];
+    time_t now = time(NULL);
+    int ready = 0;
+    pthread_mutex_lock(&meta_lock);
+    file_info *m = find_meta(pane->list_st.st_dev, e->ino);
+    if (m == NULL)
+    {
+        m = add_meta(pane->list_st.st_dev, e->ino);
+        request_meta(m, get_select_path(index, pane));
+    }
+    else if (m->ready == 1)
+    {
+        use_meta(m);
+        *info = *m;
+        ready = 1;
+
+        /* Without inotify a changed file is not reported, the details are read again after a while */
+        if (pane->watch_wd == -1 && now - m->read_at >= REFRESH / 10)
+        {
+            m->read_at = now;
+            request_meta(m, get_select_path(index, pane));
+        }
+    }
+    pthread_mutex_unlock(&meta_lock);
+    return ready;
+}
+
+void request_meta(file_info *m, char *path)
+{
+    /* The queue is full of files that have been scrolled away, the oldest one is dropped */
+    if (meta_count == META_QUEUE)
+    {
+        meta_request *old = &meta_queue[meta_head];
+        file_info *dropped = find_meta(old->dev, old->ino);
+        if (dropped != NULL && dropped->ready == 0)
+            drop_meta(dropped);
+        free(old->path);
+        meta_head = (meta_head + 1) % META_QUEUE;
+        meta_count--;
+    }
+    meta_request *request = &meta_queue[(meta_head + meta_count) % META_QUEUE];
+    request->dev = m->dev;
+    request->ino = m->ino;
+    request->path = path;
+    meta_count++;
+    pthread_cond_signal(&meta_cond);
+
+    /* The workers are started when the first details are needed */
+    if (meta_threads == 0)
+    {
+        sigset_t old_set;
+        pthread_sigmask(SIG_BLOCK, &signal_set, &old_set);
+        for (int i = 0; i < META_THREADS; i++)
+        {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, run_meta_worker, NULL) == 0)
+            {
+                pthread_detach(thread);
+                meta_threads++;
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    }
+}
+
+void *run_meta_worker(void *arg)
+{
+    (void) arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&meta_lock);
+        while (meta_count == 0)
+            pthread_cond_wait(&meta_cond, &meta_lock);
+        meta_count--;
+        meta_request request = meta_queue[(meta_head + meta_count) % META_QUEUE];
+        pthread_mutex_unlock(&meta_lock);
+
+        /* The slow part is done without the lock, the owner is looked up here as well */
+        struct stat st;
+        char owner[32] = "";
+        char mime[80] = "";
+        int ret = lstat(request.path, &st);
+        if (ret == 0 && mime_colors == 1 && S_ISDIR(st.st_mode) == 0)
+        {
+            const char *type = get_mime_type(&worker_cookie, request.path);
+            if (type != NULL)
+                snprintf(mime, sizeof(mime), "%s", type);
+        }
+        free(request.path);
+        if (ret == 0)
+        {
+            struct passwd pwd;
+            struct passwd *result = NULL;
+            char buf[1024];
+            if (getpwuid_r(st.st_uid, &pwd, buf, sizeof(buf), &result) == 0 && result != NULL)
+                snprintf(owner, sizeof(owner), "%s", pwd.pw_name);
+            else
+                snprintf(owner, sizeof(owner), "%u", (unsigned) st.st_uid);
+        }
+
+        /* The entry may have been dropped in the meantime */
+        pthread_mutex_lock(&meta_lock);
+        file_info *m = find_meta(request.dev, request.ino);
+        if (m != NULL)
+        {
+            m->ready = 1;
+            m->read_at = time(NULL);
+            m->mode = (ret == 0) ? st.st_mode : 0;
+            m->size = (ret == 0) ? st.st_size : 0;
+            m->mtime = (ret == 0) ? st.st_mtim : (struct timespec) { 0 };
+            memcpy(m->owner, owner, sizeof(owner));
+            memcpy(m->mime, mime, sizeof(mime));
+        }
+        pthread_mutex_unlock(&meta_lock);
+        if (write(meta_pipe[1], "", 1) == -1 && errno != EAGAIN)
+            continue; // The UI is woken up by the bytes already in the pipe
+    }
+    return NULL;
+}
+
+void read_meta()
+{
+    char buf[256];
+    while (read(meta_pipe[0], buf, sizeof(buf)) > 0)
+        ;
+    if (__atomic_exchange_n(&usage_ready, 0, __ATOMIC_ACQUIRE) == 1 && usage_mode == 1)
+        usage_generation++; // The panes take the new totals
+    if (details == 1 || mime_colors == 1 || preview_mode == 1)
+    {
+        left_pane.redraw = 1; // The lines are printed with the new details
+        right_pane.redraw = 1;
+    }
+}
+
+void forget_meta(pane *pane, const char *name)
+{
+    /* The file has changed, its details are read again when it is displayed */
+    char path[PATH_MAX + NAME_MAX + 2];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", (pane->path[1] == '\0') ? "" : pane->path, name);
+    if (lstat(path, &st) == -1)
+        return;
+    pthread_mutex_lock(&meta_lock);
+    file_info *m = find_meta(pane->list_st.st_dev, st.st_ino);
+    if (m != NULL && m->ready == 1)
+        drop_meta(m);
+    pthread_mutex_unlock(&meta_lock);
+    pane->redraw = 1;
+}
+
+file_info *find_meta(dev_t dev, ino_t ino)
+{
+    file_info *m = meta_table[(ino ^ dev * 0x9E3779B97F4A7C15ULL) % (META_CACHE * 2)];
+    while (m != NULL && (m->ino != ino || m->dev != dev))
+        m = m->hash_next;
+    return m;
+}
+
+file_info *add_meta(dev_t dev, ino_t ino)
+{
+    /* A free entry of the pool, or the least recently used one */
+    file_info *m;
+    if (meta_free != NULL)
+    {
+        m = meta_free;
+        meta_free = m->hash_next;
+    }
+    else if (meta_used < META_CACHE)
+        m = &meta_pool[meta_used++];
+    else
+    {
+        drop_meta(meta_oldest);
+        m = meta_free;
+        meta_free = m->hash_next;
+    }
+
+    memset(m, 0, sizeof(file_info));
+    m->dev = dev;
+    m->ino = ino;
+    file_info **bucket = &meta_table[(ino ^ dev * 0x9E3779B97F4A7C15ULL) % (META_CACHE * 2)];
+    m->hash_next = *bucket;
+    *bucket = m;
+    m->older = meta_newest;
+    if (meta_newest != NULL)
+        meta_newest->newer = m;
+    meta_newest = m;
+    if (meta_oldest == NULL)
+        meta_oldest = m;
+    return m;
+}
+
+void drop_meta(file_info *m)
+{
+    file_info **bucket = &meta_table[(m->ino ^ m->dev * 0x9E3779B97F4A7C15ULL) % (META_CACHE * 2)];
+    while (*bucket != m)
+        bucket = &(*bucket)->hash_next;
+    *bucket = m->hash_next;
+    if (m->newer != NULL)
+        m->newer->older = m->older;
+    else
+        meta_newest = m->older;
+    if (m->older != NULL)
+        m->older->newer = m->newer;
+    else
+        meta_oldest = m->newer;
+    m->hash_next = meta_free;
+    meta_free = m;
+}
+
+void use_meta(file_info *m)
+{
+    /* The entry becomes the most recently used one */
+    if (m == meta_newest)
+        return;
+    m->newer->older = m->older;
+    if (m->older != NULL)
+        m->older->newer = m->newer;
+    else
+        meta_oldest = m->newer;
+    m->newer = NULL;
+    m->older = meta_newest;
+    meta_newest->newer = m;
+    meta_newest = m;
+}
+
+void clear_meta()
+{
+    /* The details read so far are dropped, the ones being read are kept for the workers */
+    pthread_mutex_lock(&meta_lock);
+    for (file_info *m = meta_oldest, *next; m != NULL; m = next)
+    {
+        next = m->newer;
+        if (m->ready == 1)
+            drop_meta(m);
+    }
+    pthread_mutex_unlock(&meta_lock);
+}
+
+const char *get_mime_type(magic_t *cookie, const char *path)
+{
+    /* Well-known extensions do not need the magic database */
+    const char *mime = get_mime_by_ext(path);
+    if (mime != NULL)
+        return mime;
+    if (*cookie == NULL)
+    {
+        *cookie = magic_open(MAGIC_MIME_TYPE);
+        if (*cookie != NULL && magic_load(*cookie, NULL) == -1)
+        {
+            magic_close(*cookie);
+            *cookie = NULL;
+        }
+        if (*cookie == NULL)
+            return NULL;
+    }
+    return magic_file(*cookie, path);
+}
+
+const char *get_mime_by_ext(const char *name)
+{
+    /* Sorted by the extensions for the binary search */
+    static const char *types[][2] = {
+        { "7z", "application/x-7z-compressed" }, { "avi", "video/x-msvideo" }, { "bmp", "image/bmp" },
+        { "bz2", "application/x-bzip2" }, { "c", "text/x-c" }, { "cc", "text/x-c++" }, { "conf", "text/plain" },
+        { "cpp", "text/x-c++" }, { "css", "text/css" }, { "csv", "text/csv" }, { "flac", "audio/flac" },
+        { "gif", "image/gif" }, { "go", "text/x-go" }, { "gz", "application/gzip" }, { "h", "text/x-c" },
+        { "hpp", "text/x-c++" }, { "htm", "text/html" }, { "html", "text/html" }, { "java", "text/x-java" },
+        { "jpeg", "image/jpeg" }, { "jpg", "image/jpeg" }, { "js", "text/javascript" },
+        { "json", "application/json" }, { "log", "text/plain" }, { "md", "text/markdown" },
+        { "mkv", "video/x-matroska" }, { "mp3", "audio/mpeg" }, { "mp4", "video/mp4" }, { "ogg", "audio/ogg" },
+        { "pdf", "application/pdf" }, { "png", "image/png" }, { "py", "text/x-script.python" },
+        { "rs", "text/x-rust" }, { "sh", "text/x-shellscript" }, { "svg", "image/svg+xml" },
+        { "tar", "application/x-tar" }, { "tgz", "application/gzip" }, { "tif", "image/tiff" },
+        { "tiff", "image/tiff" }, { "toml", "text/plain" }, { "txt", "text/plain" }, { "wav", "audio/x-wav" },
+        { "webm", "video/webm" }, { "webp", "image/webp" }, { "xml", "text/xml" }, { "xz", "application/x-xz" },
+        { "yaml", "text/plain" }, { "yml", "text/plain" }, { "zip", "application/zip" },
+        { "zst", "application/zstd" }
+    };
+    const char *slash = strrchr(name, '/');
+    const char *dot = strrchr((slash != NULL) ? slash + 1 : name, '.');
+    if (dot == NULL || dot[1] == '\0' || dot == ((slash != NULL) ? slash + 1 : name))
+        return NULL; // No extension, or a hidden file
+    int low = 0;
+    int high = sizeof(types) / sizeof(types[0]);
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        int ret = strcasecmp(dot + 1, types[mid][0]);
+        if (ret == 0)
+            return types[mid][1];
+        if (ret < 0)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+    return NULL;
+}
+
+int get_mime_color(const char *mime)
+{
+    /* The color pair of the class of the type */
+    if (strncmp(mime, "image/", 6) == 0)
+        return 3;
+    if (strncmp(mime, "audio/", 6) == 0 || strncmp(mime, "video/", 6) == 0)
+        return 4;
+    if (strstr(mime, "zip") != NULL || strstr(mime, "compressed") != NULL || strcmp(mime, "application/x-tar") == 0 ||
+        strcmp(mime, "application/x-xz") == 0 || strcmp(mime, "application/zstd") == 0)
+        return 5;
+    if (strstr(mime, "executable") != NULL || strcmp(mime, "application/x-sharedlib") == 0)
+        return 6;
+    return 0;
+}
+
+void print_details(pane *pane, int line_pos, int index)
+{
+    /* Until a worker reads the file, the line has only the name */
+    file_info info;
+    if (get_meta(pane, index, &info) == 0)
+        return;
+    char buf[128];
+    int width = getmaxx(pane->win) - 1; // The last column is under the other pane
+    int len = get_details(&info, buf, width - 2 - DETAILS_NAME);
+    if (len == 0)
+        return;
+    wmove(pane->win, line_pos, width - len);
+    wclrtoeol(pane->win);
+    wprintw(pane->win, "%s", buf);
+}
+
+int get_details(file_info *info, char *buf, int width)
+{
+    /* The columns that fit, the size first, then the time, the permissions and the owner */
+    if (info->mode == 0)
+        return 0;
+    int widths[4] = { 11, 18, 12, 10 };
+    int shown = 0;
+    int len = 0;
+    while (shown < 4 && len + widths[shown] <= width)
+        len += widths[shown++];
+    if (shown == 0)
+        return 0;
+
+    char size[16];
+    char mtime[20];
+    char mode[11] = "?rwxrwxrwx";
+    struct tm tm;
+    get_human_filesize(info->size, size);
+    strftime(mtime, sizeof(mtime), "%Y-%m-%d %H:%M", localtime_r(&info->mtime.tv_sec, &tm));
+    const char types[16] = { [DT_DIR] = 'd', [DT_LNK] = 'l', [DT_CHR] = 'c', [DT_BLK] = 'b', [DT_FIFO] = 'p',
+                           [DT_SOCK] = 's', [DT_REG] = '-' };
+    mode[0] = (types[IFTODT(info->mode)] != '\0') ? types[IFTODT(info->mode)] : '?';
+    for (int i = 0; i < 9; i++)
+        if ((info->mode & (0400 >> i)) == 0)
+            mode[i + 1] = '-';
+
+    /* Printed in the order of ls -l */
+    len = 0;
+    if (shown > 2)
+        len += sprintf(buf + len, "  %s", mode);
+    if (shown > 3)
+        len += sprintf(buf + len, "  %-8.8s", info->owner);
+    len += sprintf(buf + len, "  %9s", size);
+    if (shown > 1)
+        len += sprintf(buf + len, "  %s", mtime);
+    return len;
+}
+
+int exist_clipboard(char *path)
+{
+    return (find_clipboard(path) != -1) ? 0 : -1;
+}
+
+int find_clipboard(const char *path)
+{
+    if (clipboard_set.slots_cap == 0)
+        return -1;
+
+    /* Linear probing, deleted slots don't stop the search */
+    unsigned int mask = clipboard_set.slots_cap - 1;
+    for (unsigned int slot = hash_path(path) & mask; ; slot = (slot + 1) & mask)
+    {
+        int index = clipboard_set.slots[slot];
+        if (index == -1)
+            return -1;
+        if (index >= 0 && strcmp(clipboard_set.paths[index], path) == 0)
+            return slot;
+    }
+}
+
+unsigned int hash_path(const char *path)
+{
+    /* FNV-1a */
+    unsigned int hash = 2166136261u;
+    while (*path != '\0')
+    {
+        hash ^= (unsigned char) *path++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void append_clipboard(char *path)
+{
+    if (insert_clipboard(path) == 0)
+        write_journal(JOURNAL_ADD, path);
+}
+
+void remove_clipboard(char *path)
+{
+    if (delete_clipboard(path) == 0)
+        write_journal(JOURNAL_REMOVE, path);
+}
+
+void clear_clipboard()
+{
+    empty_clipboard();
+    write_journal(JOURNAL_CLEAR, "");
+}
+
+int insert_clipboard(const char *path)
+{
+    if (find_clipboard(path) != -1)
+        return -1;
+
+    if (clipboard_set.len == clipboard_set.cap)
+    {
+        clipboard_set.cap = clipboard_set.cap * 2 + 64;
+        clipboard_set.paths = realloc(clipboard_set.paths, clipboard_set.cap * sizeof(char *));
+        if (clipboard_set.paths == NULL)
+        {
+            endwin();
+            perror("clipboard access error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if ((clipboard_set.slots_used + 1) * 2 > clipboard_set.slots_cap)
+        rehash_clipboard();
+
+    char *new = strdup(path);
+    if (new == NULL)
+    {
+        endwin();
+        perror("clipboard access error\n");
+        exit(EXIT_FAILURE);
+    }
+    unsigned int mask = clipboard_set.slots_cap - 1;
+    unsigned int slot = hash_path(path) & mask;
+    while (clipboard_set.slots[slot] >= 0)
+        slot = (slot + 1) & mask;
+    if (clipboard_set.slots[slot] == -1)
+        clipboard_set.slots_used++;
+    clipboard_set.slots[slot] = clipboard_set.len;
+    clipboard_set.paths[clipboard_set.len++] = new;
+    clipboard_set.live += sizeof(journal_record) + strlen(path);
+    clipboard_num++;
+    clipboard_set.changes++;
+    clipboard_set.dirty = 1;
+    return 0;
+}
+
+int delete_clipboard(const char *path)
+{
+    int slot = find_clipboard(path);
+    if (slot == -1)
+        return -1;
+
+    int index = clipboard_set.slots[slot];
+    clipboard_set.live -= sizeof(journal_record) + strlen(path);
+    free(clipboard_set.paths[index]);
+    clipboard_set.paths[index] = NULL;
+    clipboard_set.slots[slot] = -2; // Deleted
+    clipboard_num--;
+    clipboard_set.changes++;
+    clipboard_set.dirty = 1;
+    return 0;
+}
+
+void rehash_clipboard()
+{
+    /* Drop deselected paths, keeping the order of selection */
+    int len = 0;
+    for (int i = 0; i < clipboard_set.len; i++)
+        if (clipboard_set.paths[i] != NULL)
+            clipboard_set.paths[len++] = clipboard_set.paths[i];
+    clipboard_set.len = len;
+
+    int slots_cap = 64;
+    while (slots_cap < (len + 1) * 4)
+        slots_cap *= 2;
+    free(clipboard_set.slots);
+    clipboard_set.slots = malloc(slots_cap * sizeof(int));
+    if (clipboard_set.slots == NULL)
+    {
+        endwin();
+        perror("clipboard access error\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(clipboard_set.slots, -1, slots_cap * sizeof(int));
+    clipboard_set.slots_cap = slots_cap;
+    clipboard_set.slots_used = len;
+
+    unsigned int mask = slots_cap - 1;
+    for (int i = 0; i < len; i++)
+    {
+        unsigned int slot = hash_path(clipboard_set.paths[i]) & mask;
+        while (clipboard_set.slots[slot] != -1)
+            slot = (slot + 1) & mask;
+        clipboard_set.slots[slot] = i;
+    }
+}
+
+void empty_clipboard()
+{
+    for (int i = 0; i < clipboard_set.len; i++)
+        free(clipboard_set.paths[i]);
+    clipboard_set.len = 0;
+    clipboard_set.live = 0;
+    if (clipboard_set.slots != NULL)
+        memset(clipboard_set.slots, -1, clipboard_set.slots_cap * sizeof(int));
+    clipboard_set.slots_used = 0;
+    clipboard_num = 0;
+    clipboard_set.changes++;
+    clipboard_set.dirty = 1;
+}
+
+void save_clipboard()
+{
+    if (clipboard_set.dirty == 0)
+        return;
+    if (clipboard_num == 0)
+    {
+        remove(clipboard_path);
+        clipboard_set.dirty = 0;
+        return;
+    }
+
+    char *tmp_clipboard_path = NULL;
+    int alloc_size = snprintf(NULL, 0, "%s/.clipboard", conf_path);
+    tmp_clipboard_path = malloc(alloc_size + 1);
+    if (tmp_clipboard_path == NULL)
+    {
+        endwin();
+        perror("temp clipboard initialization error\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(tmp_clipboard_path, alloc_size + 1, "%s/.clipboard", conf_path);
+
+    FILE *tmp_file = fopen(tmp_clipboard_path, "w");
+    if (tmp_file == NULL)
+    {
+        endwin();
+        perror("temp clipboard access error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < clipboard_set.len; i++)
+        if (clipboard_set.paths[i] != NULL)
+            fprintf(tmp_file, "%s\n", clipboard_set.paths[i]);
+    fclose(tmp_file);
+    rename(tmp_clipboard_path, clipboard_path);
+    free(tmp_clipboard_path);
+    clipboard_set.dirty = 0;
+}
+
+void init_journal()
+{
+    int fd = open(journal_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return; // The clipboard stays local to this instance
+    clipboard_set.journal_fd = fd;
+
+    /* Byte 0 is locked for writing the journal, byte 1 is locked by every running instance */
+    lock_journal(F_OFD_SETLKW, F_WRLCK, 0);
+    int alone = lock_journal(F_OFD_SETLK, F_WRLCK, 1) == 0;
+    lock_journal(F_OFD_SETLK, F_RDLCK, 1);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (st.st_size < JOURNAL_DATA && ftruncate(fd, JOURNAL_DATA) == -1))
+    {
+        close(fd);
+        clipboard_set.journal_fd = -1;
+        return;
+    }
+    clipboard_set.journal = mmap(NULL, sizeof(journal_header), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (clipboard_set.journal == MAP_FAILED)
+    {
+        close(fd);
+        clipboard_set.journal_fd = -1;
+        clipboard_set.journal = NULL;
+        return;
+    }
+
+    /* The selection of the previous session is not restored */
+    journal_header *journal = clipboard_set.journal;
+    if (alone == 1 || memcmp(journal->magic, JOURNAL_MAGIC, sizeof(journal->magic)) != 0)
+    {
+        memcpy(journal->magic, JOURNAL_MAGIC, sizeof(journal->magic));
+        journal->length = JOURNAL_DATA;
+        journal->epoch++;
+        __atomic_add_fetch(&journal->generation, 1, __ATOMIC_RELEASE);
+        ftruncate(fd, JOURNAL_DATA);
+    }
+    clipboard_set.epoch = journal->epoch - 1; // Read the whole journal
+    read_journal();
+    lock_journal(F_OFD_SETLK, F_UNLCK, 0);
+
+    /* Writers touch the journal after updating the header, it wakes up other instances */
+    if (inotify_fd != -1)
+        inotify_add_watch(inotify_fd, journal_path, IN_ATTRIB);
+}
+
+int lock_journal(int cmd, short type, off_t start)
+{
+    struct flock lock = { .l_type = type, .l_whence = SEEK_SET, .l_start = start, .l_len = 1 };
+    return fcntl(clipboard_set.journal_fd, cmd, &lock);
+}
+
+void write_journal(int op, const char *path)
+{
+    if (clipboard_set.journal_fd == -1)
+        return;
+
+    /* Records are collected and written at once by sync_clipboard() */
+    size_t len = strlen(path);
+    size_t size = sizeof(journal_record) + len;
+    if (clipboard_set.pending_len + size > clipboard_set.pending_cap)
+    {
+        size_t cap = clipboard_set.pending_cap * 2 + 4096;
+        while (clipboard_set.pending_len + size > cap)
+            cap *= 2;
+        clipboard_set.pending = realloc(clipboard_set.pending, cap);
+        if (clipboard_set.pending == NULL)
+        {
+            endwin();
+            perror("clipboard access error\n");
+            exit(EXIT_FAILURE);
+        }
+        clipboard_set.pending_cap = cap;
+    }
+    if (op == JOURNAL_CLEAR)
+        clipboard_set.pending_len = 0; // Nothing written before matters
+    journal_record record = { .len = len, .op = op };
+    memcpy(clipboard_set.pending + clipboard_set.pending_len, &record, sizeof(journal_record));
+    memcpy(clipboard_set.pending + clipboard_set.pending_len + sizeof(journal_record), path, len);
+    clipboard_set.pending_len += size;
+}
+
+void sync_clipboard()
+{
+    journal_header *journal = clipboard_set.journal;
+    if (journal == NULL)
+        return;
+    if (clipboard_set.pending_len == 0 &&
+        __atomic_load_n(&journal->generation, __ATOMIC_ACQUIRE) == clipboard_set.generation)
+        return; // Nothing has changed
+
+    if (clipboard_set.pending_len == 0)
+    {
+        lock_journal(F_OFD_SETLKW, F_RDLCK, 0);
+        read_journal();
+        lock_journal(F_OFD_SETLK, F_UNLCK, 0);
+        return;
+    }
+
+    lock_journal(F_OFD_SETLKW, F_WRLCK, 0);
+
+    /* Changes of other instances come first, then ours are applied again on top of them */
+    if (__atomic_load_n(&journal->generation, __ATOMIC_ACQUIRE) != clipboard_set.generation)
+    {
+        read_journal();
+        for (size_t pos = 0; pos < clipboard_set.pending_len; )
+        {
+            journal_record record;
+            memcpy(&record, clipboard_set.pending + pos, sizeof(journal_record));
+            char path[PATH_MAX];
+            size_t len = (record.len < PATH_MAX) ? record.len : PATH_MAX - 1;
+            memcpy(path, clipboard_set.pending + pos + sizeof(journal_record), len);
+            path[len] = '\0';
+            if (record.op == JOURNAL_ADD)
+                insert_clipboard(path);
+            else if (record.op == JOURNAL_REMOVE)
+                delete_clipboard(path);
+            else
+                empty_clipboard();
+            pos += sizeof(journal_record) + record.len;
+        }
+    }
+
+    if (pwrite(clipboard_set.journal_fd, clipboard_set.pending, clipboard_set.pending_len,
+               journal->length) == (ssize_t) clipboard_set.pending_len)
+    {
+        journal->length += clipboard_set.pending_len;
+        clipboard_set.offset = journal->length;
+        clipboard_set.generation = __atomic_add_fetch(&journal->generation, 1, __ATOMIC_RELEASE);
+    }
+    clipboard_set.pending_len = 0;
+
+    /* Most of the records are outdated */
+    if (journal->length - JOURNAL_DATA > 65536 && journal->length - JOURNAL_DATA > 4 * clipboard_set.live)
+        compact_journal();
+    else if (clipboard_num == 0 && journal->length > JOURNAL_DATA)
+        compact_journal();
+    futimens(clipboard_set.journal_fd, NULL);
+    lock_journal(F_OFD_SETLK, F_UNLCK, 0);
+}
+
+void read_journal()
+{
+    journal_header *journal = clipboard_set.journal;
+    if (journal->epoch != clipboard_set.epoch || journal->length < clipboard_set.offset)
+    {
+        /* The journal was compacted, read it from the beginning */
+        empty_clipboard();
+        clipboard_set.epoch = journal->epoch;
+        clipboard_set.offset = JOURNAL_DATA;
+    }
+
+    size_t size = journal->length - clipboard_set.offset;
+    char *buf = malloc(size + 1);
+    if (buf == NULL)
+    {
+        endwin();
+        perror("clipboard access error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (size > 0 && pread(clipboard_set.journal_fd, buf, size, clipboard_set.offset) != (ssize_t) size)
+        size = 0;
+
+    for (size_t pos = 0; pos + sizeof(journal_record) <= size; )
+    {
+        journal_record record;
+        memcpy(&record, buf + pos, sizeof(journal_record));
+        if (pos + sizeof(journal_record) + record.len > size || record.len >= PATH_MAX)
+            break;
+        char path[PATH_MAX];
+        memcpy(path, buf + pos + sizeof(journal_record), record.len);
+        path[record.len] = '\0';
+        if (record.op == JOURNAL_ADD)
+            insert_clipboard(path);
+        else if (record.op == JOURNAL_REMOVE)
+            delete_clipboard(path);
+        else
+            empty_clipboard();
+        pos += sizeof(journal_record) + record.len;
+    }
+    free(buf);
+
+    clipboard_set.offset = journal->length;
+    clipboard_set.generation = __atomic_load_n(&journal->generation, __ATOMIC_ACQUIRE);
+}
+
+void compact_journal()
+{
+    /* Rewrite the journal in place: other instances keep it mapped */
+    journal_header *journal = clipboard_set.journal;
+    char *buf = malloc(clipboard_set.live + 1);
+    if (buf == NULL)
+    {
+        endwin();
+        perror("clipboard access error\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t len = 0;
+    for (int i = 0; i < clipboard_set.len; i++)
+    {
+        if (clipboard_set.paths[i] == NULL)
+            continue;
+        journal_record record = { .len = strlen(clipboard_set.paths[i]), .op = JOURNAL_ADD };
+        memcpy(buf + len, &record, sizeof(journal_record));
+        memcpy(buf + len + sizeof(journal_record), clipboard_set.paths[i], record.len);
+        len += sizeof(journal_record) + record.len;
+    }
+
+    if (len == 0 || pwrite(clipboard_set.journal_fd, buf, len, JOURNAL_DATA) == (ssize_t) len)
+    {
+        ftruncate(clipboard_set.journal_fd, JOURNAL_DATA + len);
+        journal->length = JOURNAL_DATA + len;
+        clipboard_set.epoch = ++journal->epoch;
+        clipboard_set.offset = journal->length;
+        clipboard_set.generation = __atomic_add_fetch(&journal->generation, 1, __ATOMIC_RELEASE);
+    }
+    free(buf);
+}
+
+void close_clipboard()
+{
+    sync_clipboard();
+    int alone = 1;
+    if (clipboard_set.journal != NULL)
+    {
+        /* Keep the selection while other instances are running */
+        lock_journal(F_OFD_SETLK, F_UNLCK, 1);
+        alone = lock_journal(F_OFD_SETLK, F_WRLCK, 1) == 0;
+        if (alone == 1)
+        {
+            lock_journal(F_OFD_SETLKW, F_WRLCK, 0);
+            empty_clipboard();
+            compact_journal();
+            futimens(clipboard_set.journal_fd, NULL);
+        }
+        munmap(clipboard_set.journal, sizeof(journal_header));
+        close(clipboard_set.journal_fd); // Releases the locks
+    }
+    if (alone == 1)
+        remove(clipboard_path);
+
+    empty_clipboard();
+    free(clipboard_set.paths);
+    free(clipboard_set.slots);
+    free(clipboard_set.pending);
+}
+
+void remove_files(pane *pane)
+{
+    job *job = new_job(TASK_DELETE);
+    if (clipboard_num != 0)
+    {
+        for (int i = 0; i < clipboard_set.len; i++)
+        {
+            char *buf = clipboard_set.paths[i];
+            if (buf != NULL)
+                rm_file(job, buf);
+        }
+        clear_clipboard();
+        pane->select = 1;
+    }
+    else if (rm_file(job, pane->select_path) == 0)
+        pane->select = 1;
+    start_job(job);
+}
+
+int rm_file(job *job, char *path)
+{
+    if (access(path, W_OK) == 0)
+    {
+        push_task(job, TASK_DELETE, path, NULL);
+        return 0;
+    }
+    add_failure(job, path, NULL, EACCES);
+    return -1;
+}
+
+void delete_task(job *job, task *task)
+{
+    struct stat st;
+    if (lstat(task->src, &st) == -1)
+    {
+        add_failure(job, task->src, NULL, errno);
+        return;
+    }
+    if (S_ISDIR(st.st_mode) == 0)
+    {
+        if (unlink(task->src) == -1)
+            add_failure(job, task->src, NULL, errno);
+        else
+            __atomic_add_fetch(&job->removed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    int fd = open(task->src, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    size_t cap = COPY_DIRBUF * 2;
+    char *buf = malloc(cap);
+    size_t used = 0;
+    long len = 0;
+    if (fd == -1 || buf == NULL)
+        add_failure(job, task->src, NULL, (fd == -1) ? errno : ENOMEM);
+    else
+        task->remove_dir = 1; // By the last finished subdirectory
+
+    /* The whole directory is read before anything is removed, NFS and some FUSE file systems skip
+       entries when the directory changes between two reads */
+    while (fd != -1 && buf != NULL && check_job(job) == 0 && (len = getdents64(fd, buf + used, cap - used)) > 0)
+    {
+        used += len;
+        if (cap - used < COPY_DIRBUF)
+        {
+            cap *= 2;
+            char *new = realloc(buf, cap);
+            if (new == NULL)
+            {
+                endwin();
+                perror("memory allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+            buf = new;
+        }
+    }
+
+    /* Files are removed here, subdirectories go to other workers */
+    for (size_t pos = 0; pos < used && check_job(job) == 0; )
+    {
+        struct dirent64 *pDirent = (struct dirent64 *) (buf + pos);
+        char *name = pDirent->d_name;
+        pos += pDirent->d_reclen;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+        if ((pDirent->d_type == DT_DIR || pDirent->d_type == DT_UNKNOWN) &&
+            fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))
+            push_child_task(job, task, name, st.st_dev, st.st_dev);
+        else if (unlinkat(fd, name, 0) == -1)
+            add_failure(job, task->src, name, errno);
+        else
+            __atomic_add_fetch(&job->removed, 1, __ATOMIC_RELAXED);
+    }
+    free(buf);
+    if (fd != -1)
+        close(fd);
+}
+
+void yank_files(pane *pane)
+{
+    job *job = new_job(TASK_COPY);
+    if (clipboard_num != 0)
+    {
+        for (int i = 0; i < clipboard_set.len; i++)
+        {
+            char *buf = clipboard_set.paths[i];
+            if (buf != NULL && cp_file(job, buf, pane->path) == -1)
+                add_failure(job, buf, NULL, errno);
+        }
+        clear_clipboard();
+        pane->select = 1;
+    }
+    else
+    {
+        /* Make a copy of the selected file in the current directory. */
+        if (access(pane->path, W_OK) == 0)
+        {
+            int alloc_size = snprintf(NULL, 0, "%s~", pane->select_path);
+            char *cpy_path = malloc(alloc_size + 1);
+            if (cpy_path == NULL)
+            {
+                endwin();
+                perror("memory allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+            snprintf(cpy_path, alloc_size + 1, "%s~", pane->select_path);
+
+            /* A directory is not merged into an old copy */
+            struct stat st;
+            if (lstat(pane->select_path, &st) == 0 && S_ISDIR(st.st_mode) && lstat(cpy_path, &st) == 0)
+                add_failure(job, cpy_path, NULL, EEXIST);
+            else
+                push_task(job, TASK_COPY, pane->select_path, cpy_path);
+            free(cpy_path);
+        }
+        else
+            add_failure(job, pane->path, NULL, EACCES);
+    }
+    start_job(job);
+}
+
+int cp_file(job *job, char *path, char *dir)
+{
+    if (access(dir, W_OK) != 0)
+    {
+        errno = EACCES;
+        return -1;
+    }
+
+    struct stat src_st;
+    struct stat dst_st;
+    if (lstat(path, &src_st) == -1)
+        return -1;
+
+    /* Like cp, refuse to copy a directory into itself */
+    if (S_ISDIR(src_st.st_mode))
+    {
+        char src_real[PATH_MAX];
+        char dst_real[PATH_MAX];
+        if (realpath(path, src_real) == NULL || realpath(dir, dst_real) == NULL)
+            return -1;
+        size_t len = strlen(src_real);
+        if (strncmp(src_real, dst_real, len) == 0 && (dst_real[len] == '/' || dst_real[len] == '\0'))
+        {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    char *name = strrchr(path, '/') + 1;
+    int alloc_size = snprintf(NULL, 0, "%s/%s", dir, name);
+    char *dst_path = malloc(alloc_size + 1);
+    if (dst_path == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(dst_path, alloc_size + 1, "%s/%s", (dir[1] == '\0') ? "" : dir, name);
+
+    int ret = -1;
+    if (lstat(dst_path, &dst_st) == -1 ||
+        dst_st.st_dev != src_st.st_dev || dst_st.st_ino != src_st.st_ino) // Not the same file
+    {
+        push_task(job, TASK_COPY, path, dst_path);
+        ret = 0;
+    }
+    else
+        errno = EEXIST;
+    free(dst_path);
+    return ret;
+}
+
+void copy_task(job *job, task *task)
+{
+    struct stat st;
+    if (lstat(task->src, &st) == -1)
+    {
+        fail_task(job, task);
+        return;
+    }
+    if (S_ISDIR(st.st_mode) == 0)
+    {
+        if (copy_file(AT_FDCWD, task->src, AT_FDCWD, task->dst, job) == -1)
+        {
+            if (errno == EISDIR || errno == ENOTDIR) // Not replaced by a file of another type
+                add_failure(job, task->dst, NULL, errno);
+            fail_task(job, task);
+        }
+        return;
+    }
+
+    /* An existing directory is merged with the copied one, like cp -r a file is not replaced by it */
+    struct stat dst_st;
+    int exists = lstat(task->dst, &dst_st) == 0;
+    if (exists == 1 && S_ISDIR(dst_st.st_mode) == 0)
+    {
+        errno = ENOTDIR;
+        add_failure(job, task->dst, NULL, errno);
+        fail_task(job, task);
+        return;
+    }
+    if (exists == 0)
+    {
+        if (mkdir(task->dst, S_IRWXU) == -1)
+        {
+            fail_task(job, task);
+            return;
+        }
+
+        /* The directory stays writable until the job is finished */
+        pthread_mutex_lock(&job->lock);
+        if (job->modes_num == job->modes_cap)
+        {
+            job->modes_cap = job->modes_cap * 2 + 16;
+            job->modes = realloc(job->modes, job->modes_cap * sizeof(dir_mode));
+            if (job->modes == NULL)
+            {
+                endwin();
+                perror("memory allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        job->modes[job->modes_num].path = strdup(task->dst);
+        job->modes[job->modes_num++].mode = st.st_mode & 07777 & ~file_mask;
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    int src_fd = open(task->src, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    int dst_fd = open(task->dst, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    char *buf = malloc(COPY_DIRBUF);
+    long len = 0;
+    if (src_fd == -1 || dst_fd == -1 || buf == NULL)
+        fail_task(job, task);
+    else
+        len = getdents64(src_fd, buf, COPY_DIRBUF);
+
+    /* Subdirectories are copied by other workers, files right here */
+    while (len > 0)
+    {
+        for (long pos = 0; pos < len; )
+        {
+            struct dirent64 *pDirent = (struct dirent64 *) (buf + pos);
+            char *name = pDirent->d_name;
+            pos += pDirent->d_reclen;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            if ((pDirent->d_type == DT_DIR || pDirent->d_type == DT_UNKNOWN) &&
+                fstatat(src_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))
+            {
+                /* The copy is made on the device of the directory it goes to, unless it is already there */
+                dev_t dst_dev = (fstatat(dst_fd, name, &dst_st, AT_SYMLINK_NOFOLLOW) == 0) ? dst_st.st_dev :
+                                                                                             task->dst_dev;
+                push_child_task(job, task, name, st.st_dev, dst_dev);
+            }
+            else if (copy_file(src_fd, name, dst_fd, name, job) == -1)
+            {
+                if (errno == EISDIR || errno == ENOTDIR)
+                    add_failure(job, task->dst, name, errno);
+                fail_task(job, task);
+            }
+            if (check_job(job) == -1)
+                break;
+        }
+        len = (check_job(job) == 0) ? getdents64(src_fd, buf, COPY_DIRBUF) : 0;
+    }
+    free(buf);
+    if (src_fd != -1)
+        close(src_fd);
+    if (dst_fd != -1)
+        close(dst_fd);
+}
+
+void fail_task(job *job, task *task)
+{
+    if (task->root != NULL)
+        __atomic_store_n(&task->root->error, (errno != 0) ? errno : EIO, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&job->errors, 1, __ATOMIC_RELAXED);
+}
+
+void scan_task(job *job, task *task)
+{
+    struct stat st;
+    if (lstat(task->src, &st) == -1)
+        return;
+    if (S_ISDIR(st.st_mode) == 0)
+    {
+        __atomic_add_fetch(&job->files_total, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&job->bytes_total, st.st_size, __ATOMIC_RELAXED);
+        return;
+    }
+
+    int fd = open(task->src, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    char *buf = malloc(COPY_DIRBUF);
+    long len = 0;
+    if (fd != -1 && buf != NULL)
+        len = getdents64(fd, buf, COPY_DIRBUF);
+    while (len > 0)
+    {
+        for (long pos = 0; pos < len; )
+        {
+            struct dirent64 *pDirent = (struct dirent64 *) (buf + pos);
+            char *name = pDirent->d_name;
+            pos += pDirent->d_reclen;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+                continue;
+            if (S_ISDIR(st.st_mode))
+                push_child_task(job, task, name, st.st_dev, (task->dst != NULL) ? task->dst_dev : st.st_dev);
+            else
+            {
+                __atomic_add_fetch(&job->files_total, 1, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&job->bytes_total, st.st_size, __ATOMIC_RELAXED);
+            }
+        }
+        len = (check_job(job) == 0) ? getdents64(fd, buf, COPY_DIRBUF) : 0;
+    }
+    free(buf);
+    if (fd != -1)
+        close(fd);
+}
+
+int copy_file(int src_dirfd, const char *src_name, int dst_dirfd, const char *dst_name, job *job)
+{
+    struct stat st;
+    struct stat dst_st;
+    if (fstatat(src_dirfd, src_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+        return -1;
+    if (fstatat(dst_dirfd, dst_name, &dst_st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(dst_st.st_mode))
+    {
+        errno = EISDIR; // Like cp, a directory is not replaced by a file
+        return -1;
+    }
+    if (backup_file(dst_dirfd, dst_name) == -1)
+        return -1;
+
+    int ret = 0;
+    if (S_ISLNK(st.st_mode))
+    {
+        /* Symbolic links and special files are recreated as cp -r does */
+        char target[PATH_MAX];
+        ssize_t len = readlinkat(src_dirfd, src_name, target, sizeof(target) - 1);
+        if (len == -1)
+            return -1;
+        target[len] = '\0';
+        ret = symlinkat(target, dst_dirfd, dst_name);
+    }
+    else if (S_ISREG(st.st_mode) == 0)
+        ret = mknodat(dst_dirfd, dst_name, st.st_mode, st.st_rdev);
+    else
+    {
+        int src_fd = openat(src_dirfd, src_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (src_fd == -1)
+            return -1;
+        int dst_fd = openat(dst_dirfd, dst_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+        if (dst_fd == -1)
+        {
+            close(src_fd);
+            return -1;
+        }
+        ret = copy_data(src_fd, dst_fd, st.st_size, job);
+        close(src_fd);
+        if (close(dst_fd) == -1)
+            ret = -1;
+    }
+    __atomic_add_fetch(&job->files_done, 1, __ATOMIC_RELAXED);
+    return ret;
+}
+
+int copy_data(int src_fd, int dst_fd, off_t size, job *job)
+{
+    /* Share the extents on copy-on-write file systems (btrfs, xfs) */
+    if (ioctl(dst_fd, FICLONE, src_fd) == 0)
+    {
+        __atomic_add_fetch(&job->bytes_done, size, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    /* Copy only the data segments, holes stay holes */
+    off_t data = 0;
+    off_t done = 0;
+    while (data < size)
+    {
+        off_t hole;
+        data = lseek(src_fd, data, SEEK_DATA);
+        if (data == -1 && errno == ENXIO)
+            break; // The rest of the file is a hole
+        if (data == -1)
+        {
+            data = 0; // SEEK_DATA isn't supported
+            hole = size;
+        }
+        else if ((hole = lseek(src_fd, data, SEEK_HOLE)) == -1 || hole > size)
+            hole = size;
+        if (copy_range(src_fd, dst_fd, data, hole - data, job) == -1)
+            return -1;
+        done += hole - data;
+        data = hole;
+    }
+    __atomic_add_fetch(&job->bytes_done, size - done, __ATOMIC_RELAXED); // Holes
+    return ftruncate(dst_fd, size); // Keep the hole at the end
+}
+
+int copy_range(int src_fd, int dst_fd, off_t offset, off_t len, job *job)
+{
+    off_t in = offset;
+    off_t out = offset;
+
+    /* Let the kernel copy the data, in chunks to report the progress */
+    while (len > 0)
+    {
+        if (check_job(job) == -1)
+            return -1;
+        ssize_t ret = copy_file_range(src_fd, &in, dst_fd, &out, (len < COPY_CHUNK) ? len : COPY_CHUNK, 0);
+        if (ret == 0)
+            return 0; // The file has become shorter
+        if (ret == -1)
+            break;
+        len -= ret;
+        __atomic_add_fetch(&job->bytes_done, ret, __ATOMIC_RELAXED);
+    }
+    if (len == 0)
+        return 0;
+    if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+        return -1;
+
+    /* Fall back to read/write with a large buffer */
+    char *buf = malloc(COPY_BUF);
+    if (buf == NULL)
+        return -1;
+    while (len > 0)
+    {
+        if (check_job(job) == -1)
+        {
+            free(buf);
+            return -1;
+        }
+        ssize_t ret = pread(src_fd, buf, (len < COPY_BUF) ? len : COPY_BUF, in);
+        if (ret <= 0)
+            break;
+        for (ssize_t done = 0; done < ret; )
+        {
+            ssize_t written = pwrite(dst_fd, buf + done, ret - done, out);
+            if (written == -1)
+            {
+                free(buf);
+                return -1;
+            }
+            done += written;
+            out += written;
+        }
+        in += ret;
+        len -= ret;
+        __atomic_add_fetch(&job->bytes_done, ret, __ATOMIC_RELAXED);
+    }
+    free(buf);
+    return (len == 0) ? 0 : -1;
+}
+
+int backup_file(int dirfd, const char *name)
+{
+    /* Rename an existing file to name~ as cp -b does, an old backup of another type stays */
+    struct stat st;
+    struct stat backup_st;
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+        return 0;
+    char backup[PATH_MAX + 1];
+    snprintf(backup, sizeof(backup), "%s~", name);
+    if (fstatat(dirfd, backup, &backup_st, AT_SYMLINK_NOFOLLOW) == 0 &&
+        S_ISDIR(backup_st.st_mode) != S_ISDIR(st.st_mode))
+    {
+        errno = S_ISDIR(backup_st.st_mode) ? EISDIR : ENOTDIR;
+        return -1;
+    }
+    return renameat(dirfd, name, dirfd, backup);
+}
+
+job *new_job(int kind)
+{
+    job *new = calloc(1, sizeof(job));
+    if (new == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    new->kind = kind;
+    pthread_mutex_init(&new->lock, NULL);
+    pthread_cond_init(&new->cond, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &new->start);
+    return new;
+}
+
+void free_job(job *job)
+{
+    while (job->head != NULL)
+    {
+        task *next = job->head->next;
+        free(job->head->src);
+        free(job->head->dst);
+        free(job->head);
+        job->head = next;
+    }
+    while (job->roots != NULL)
+    {
+        task *next = job->roots->next;
+        free(job->roots->src);
+        free(job->roots->dst);
+        free(job->roots);
+        job->roots = next;
+    }
+    for (int i = 0; i < job->modes_num; i++)
+        free(job->modes[i].path);
+    free(job->modes);
+    for (int i = 0; i < job->failed_num; i++)
+        free(job->failed[i]);
+    free(job->failed);
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->cond);
+    free(job);
+}
+
+void push_task(job *job, int kind, const char *src, const char *dst)
+{
+    /* The top-level tasks are kept to run them again in the next phase of the job */
+    task *root = calloc(1, sizeof(task));
+    if (root == NULL || (root->src = strdup(src)) == NULL || (dst != NULL && (root->dst = strdup(dst)) == NULL))
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    root->kind = kind;
+    root->pending = 1;
+    struct stat st;
+    root->src_dev = (lstat(src, &st) == 0) ? st.st_dev : 0;
+    root->dst_dev = root->src_dev;
+    if (dst != NULL)
+    {
+        char *dir = strdup(dst);
+        if (dir == NULL)
+        {
+            endwin();
+            perror("memory allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        *strrchr(dir, '/') = '\0';
+        root->dst_dev = (stat((dir[0] == '\0') ? "/" : dir, &st) == 0) ? st.st_dev : 0;
+        free(dir);
+    }
+    root->next = job->roots;
+    job->roots = root;
+}
+
+void push_child_task(job *job, task *parent, const char *name, dev_t src_dev, dev_t dst_dev)
+{
+    /* The devices are those of the subdirectory, a mount point inside the tree has its own limit */
+    task *new = calloc(1, sizeof(task));
+    if (new == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    int alloc_size = snprintf(NULL, 0, "%s/%s", parent->src, name);
+    new->src = malloc(alloc_size + 1);
+    if (parent->dst != NULL)
+    {
+        alloc_size = snprintf(NULL, 0, "%s/%s", parent->dst, name);
+        new->dst = malloc(alloc_size + 1);
+    }
+    if (new->src == NULL || (parent->dst != NULL && new->dst == NULL))
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(new->src, "%s/%s", parent->src, name);
+    if (parent->dst != NULL)
+        sprintf(new->dst, "%s/%s", parent->dst, name);
+    new->kind = parent->kind;
+    new->root = parent->root;
+    new->src_dev = src_dev;
+    new->dst_dev = dst_dev;
+    new->pending = 1;
+    if (new->kind == TASK_DELETE)
+    {
+        new->parent = parent; // Kept until the subdirectory is removed
+        __atomic_add_fetch(&parent->pending, 1, __ATOMIC_ACQ_REL);
+    }
+
+    pthread_mutex_lock(&job->lock);
+    queue_task(job, new);
+    pthread_cond_broadcast(&job->cond); // The UI thread waits on it too
+    pthread_mutex_unlock(&job->lock);
+}
+
+void queue_task(job *job, task *task)
+{
+    task->next = NULL;
+    if (job->tail == NULL)
+        job->head = task;
+    else
+        job->tail->next = task;
+    job->tail = task;
+}
+
+void start_job(job *job)
+{
+    if (job->roots == NULL)
+    {
+        reap_job(job); // Nothing to do, but there may be errors to show
+        return;
+    }
+
+    /* The list is kept in the order the jobs were started */
+    job->number = ++jobs_num;
+    struct job **last = &jobs;
+    while (*last != NULL)
+        last = &(*last)->next;
+    *last = job;
+
+    /* SIGWINCH must reach the UI thread, not the workers */
+    sigset_t old_set;
+    pthread_sigmask(SIG_BLOCK, &signal_set, &old_set);
+    if (pthread_create(&job->thread, NULL, run_job, job) == 0)
+        job->threaded = 1;
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    if (job->threaded == 0)
+        run_job(job);
+}
+
+void *run_job(void *arg)
+{
+    job *job = arg;
+
+    /* Count the files first to know how long the job will take */
+    if (job->kind == TASK_DELETE)
+        run_phase(job, TASK_DELETE);
+    else
+    {
+        run_phase(job, TASK_SCAN);
+        run_phase(job, TASK_COPY);
+
+        /* Directories get their permissions when nothing more is written into them */
+        for (int i = job->modes_num - 1; i >= 0; i--)
+            chmod(job->modes[i].path, job->modes[i].mode);
+    }
+
+    /* The moved files are removed only if they are copied completely */
+    if (job->kind == TASK_MOVE)
+    {
+        for (task *root = job->roots; root != NULL; root = root->next)
+            if (root->error != 0 && job->cancelled == 0)
+                add_failure(job, root->src, NULL, root->error);
+        run_phase(job, TASK_DELETE);
+    }
+
+    if (write(jobs_pipe[1], &job, sizeof(job)) != sizeof(job))
+    {
+        endwin();
+        perror("pipe write error\n");
+        exit(EXIT_FAILURE);
+    }
+    return NULL;
+}
+
+void run_phase(job *job, int kind)
+{
+    if (__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED) != 0)
+        return;
+    __atomic_store_n(&job->phase, kind, __ATOMIC_RELAXED);
+    for (task *root = job->roots; root != NULL; root = root->next)
+    {
+        if (kind == TASK_DELETE && root->error != 0)
+            continue;
+        task *new = malloc(sizeof(task));
+        if (new == NULL)
+        {
+            endwin();
+            perror("memory allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        *new = *root;
+        new->root = root;
+        new->kind = kind;
+        new->pending = 1;
+        new->src = strdup(root->src);
+        new->dst = (root->dst != NULL) ? strdup(root->dst) : NULL;
+        queue_task(job, new);
+    }
+
+    pthread_t threads[COPY_THREADS];
+    int threads_num = 0;
+    for (int i = 0; i < COPY_THREADS; i++)
+        if (pthread_create(&threads[threads_num], NULL, run_worker, job) == 0)
+            threads_num++;
+    if (threads_num == 0)
+        run_worker(job);
+    for (int i = 0; i < threads_num; i++)
+        pthread_join(threads[i], NULL);
+}
+
+void *run_worker(void *arg)
+{
+    job *job = arg;
+    pthread_mutex_lock(&job->lock);
+    for (;;)
+    {
+        /* A cancelled job drops the queued tasks */
+        if (job->cancelled != 0 && job->head != NULL)
+        {
+            task *head = job->head;
+            job->head = NULL;
+            job->tail = NULL;
+            job->running++;
+            pthread_mutex_unlock(&job->lock);
+            while (head != NULL)
+            {
+                task *next = head->next;
+                finish_task(job, head);
+                head = next;
+            }
+            pthread_mutex_lock(&job->lock);
+            job->running--;
+            continue;
+        }
+
+        unsigned changes = 0;
+        task *task = (job->paused == 0) ? take_task(job, &changes) : NULL;
+        if (task == NULL)
+        {
+            if (job->head == NULL && job->running == 0)
+                break; // Nothing left to do
+            if (job->head != NULL && job->paused == 0)
+            {
+                /* The devices are busy, perhaps with the tasks of another job */
+                pthread_mutex_unlock(&job->lock);
+                pthread_mutex_lock(&devices_lock);
+                while (devices_changes == changes)
+                    pthread_cond_wait(&devices_cond, &devices_lock);
+                pthread_mutex_unlock(&devices_lock);
+                pthread_mutex_lock(&job->lock);
+                continue;
+            }
+            pthread_cond_wait(&job->cond, &job->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&job->lock);
+
+        int64_t start = start_timer();
+        if (task->kind == TASK_SCAN)
+            scan_task(job, task);
+        else if (task->kind == TASK_DELETE)
+            delete_task(job, task);
+        else
+            copy_task(job, task);
+        count_time(STATS_FILES, start);
+        dev_t src_dev = task->src_dev;
+        dev_t dst_dev = task->dst_dev;
+        finish_task(job, task);
+
+        release_devices(src_dev, dst_dev);
+        pthread_mutex_lock(&job->lock);
+        job->running--;
+        pthread_cond_broadcast(&job->cond);
+    }
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+int check_job(job *job)
+{
+    /* A paused job waits here, in the middle of its tasks */
+    if (__atomic_load_n(&job->paused, __ATOMIC_RELAXED) != 0)
+    {
+        pthread_mutex_lock(&job->lock);
+        while (job->paused != 0 && job->cancelled == 0)
+            pthread_cond_wait(&job->cond, &job->lock);
+        pthread_mutex_unlock(&job->lock);
+    }
+    if (__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED) != 0)
+    {
+        errno = ECANCELED;
+        return -1;
+    }
+    return 0;
+}
+
+void read_jobs()
+{
+    job *job;
+    while (read(jobs_pipe[0], &job, sizeof(job)) == sizeof(job))
+        reap_job(job);
+}
+
+void reap_job(job *job)
+{
+    char *titles[] = { "", "Not copied", "Not deleted", "Not moved" };
+    if (job->threaded == 1)
+        pthread_join(job->thread, NULL);
+    for (struct job **prev = &jobs; *prev != NULL; prev = &(*prev)->next)
+    {
+        if (*prev == job)
+        {
+            *prev = job->next;
+            break;
+        }
+    }
+
+    if (job->cancelled != 0)
+        print_notification("The job is cancelled.");
+    else if (job->failed_num != 0)
+        print_failures(job, titles[job->kind]);
+    else if (job->errors != 0)
+        print_notification("Some files aren't copied completely!");
+    free_job(job);
+    invalidate_listings();
+}
+
+void wait_jobs()
+{
+    /* Nobody can resume a paused job any more, it is cancelled */
+    for (job *job = jobs; job != NULL; job = job->next)
+        if (__atomic_load_n(&job->paused, __ATOMIC_RELAXED) != 0)
+            cancel_job(job);
+
+    wtimeout(status_bar, 0);
+    while (jobs != NULL)
+    {
+        wattron(status_bar, COLOR_PAIR(2));
+        print_line(status_bar, 1, "Waiting for the jobs, any key cancels them...");
+        wattroff(status_bar, COLOR_PAIR(2));
+        print_jobs();
+        wrefresh(status_bar);
+
+        struct pollfd fds[2] = { { jobs_pipe[0], POLLIN, 0 }, { STDIN_FILENO, POLLIN, 0 } };
+        if (poll(fds, 2, JOB_REFRESH * 100) <= 0)
+            continue;
+        if ((fds[1].revents & POLLIN) != 0 && read_key(status_bar) != ERR)
+            for (job *job = jobs; job != NULL; job = job->next)
+                cancel_job(job);
+        if ((fds[0].revents & POLLIN) != 0)
+            read_jobs();
+    }
+}
+
+void cancel_job(job *job)
+{
+    /* The workers waiting in check_job() or for the devices are woken up to stop */
+    pthread_mutex_lock(&job->lock);
+    __atomic_store_n(&job->cancelled, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    pthread_mutex_lock(&devices_lock);
+    devices_changes++;
+    pthread_cond_broadcast(&devices_cond);
+    pthread_mutex_unlock(&devices_lock);
+}
+
+void manage_jobs()
+{
+    /* One line per job, they are chosen by the line number */
+    char buf[PATH_MAX];
+    int num = 0;
+    for (job *job = jobs; job != NULL; job = job->next)
+        num++;
+    if (num > 9)
+        num = 9;
+    WINDOW *list = create_window(num + 3, termsize_x, termsize_y - num - 4, 0);
+    wattron(list, COLOR_PAIR(2));
+    wmove(list, 1, 1);
+    wprintw(list, "job\tprogress (number, then %c to pause/resume or %c to cancel)", KEY_JOBPAUSE, KEY_JOBCANCEL);
+    wattroff(list, COLOR_PAIR(2));
+    int i = 0;
+    for (job *job = jobs; job != NULL && i < num; job = job->next, i++)
+    {
+        wmove(list, i + 2, 1);
+        wprintw(list, " %d\t%s", i + 1, get_job_progress(job, buf, sizeof(buf)));
+    }
+    box(list, 0, 0);
+    wrefresh(list);
+
+    int key = read_key(list) - '0';
+    job *selected = jobs;
+    for (i = 1; selected != NULL && i < key; i++)
+        selected = selected->next;
+    if (key >= 1 && key <= num && selected != NULL)
+    {
+        int action = read_key(list);
+        if (action == KEY_JOBPAUSE)
+        {
+            pthread_mutex_lock(&selected->lock);
+            __atomic_store_n(&selected->paused, !selected->paused, __ATOMIC_RELAXED);
+            pthread_cond_broadcast(&selected->cond);
+            pthread_mutex_unlock(&selected->lock);
+        }
+        else if (action == KEY_JOBCANCEL)
+            cancel_job(selected);
+    }
+    close_window(list);
+}
+
+task *take_task(job *job, unsigned *changes)
+{
+    /* The first task whose devices are not busy */
+    task *prev = NULL;
+    pthread_mutex_lock(&devices_lock);
+    *changes = devices_changes; // Nothing to take until it changes
+    for (task *task = job->head; task != NULL; prev = task, task = task->next)
+    {
+        device *src = get_device(task->src_dev);
+        device *dst = get_device(task->dst_dev);
+        if ((src != NULL && src->active >= src->limit) || (dst != NULL && dst->active >= dst->limit))
+            continue;
+
+        if (prev == NULL)
+            job->head = task->next;
+        else
+            prev->next = task->next;
+        if (job->tail == task)
+            job->tail = prev;
+        if (src != NULL)
+            src->active++;
+        if (dst != NULL && dst != src)
+            dst->active++;
+        pthread_mutex_unlock(&devices_lock);
+        job->running++;
+        return task;
+    }
+    pthread_mutex_unlock(&devices_lock);
+    return NULL;
+}
+
+void finish_task(job *job, task *task)
+{
+    /* The last finished entry of a directory removes it, then its parent may follow */
+    while (task != NULL && __atomic_sub_fetch(&task->pending, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        if (task->remove_dir == 1 && rmdir(task->src) == -1)
+            add_failure(job, task->src, NULL, errno);
+        else if (task->remove_dir == 1)
+            __atomic_add_fetch(&job->removed, 1, __ATOMIC_RELAXED);
+        struct task *parent = task->parent;
+        free(task->src);
+        free(task->dst);
+        free(task);
+        task = parent;
+    }
+}
+
+void release_devices(dev_t src_dev, dev_t dst_dev)
+{
+    pthread_mutex_lock(&devices_lock);
+    device *src = get_device(src_dev);
+    device *dst = get_device(dst_dev);
+    if (src != NULL)
+        src->active--;
+    if (dst != NULL && dst != src)
+        dst->active--;
+    devices_changes++;
+    pthread_cond_broadcast(&devices_cond); // The workers of all jobs may take a task now
+    pthread_mutex_unlock(&devices_lock);
+}
+
+device *get_device(dev_t dev)
+{
+    /* Called with devices_lock held */
+    for (int i = 0; i < devices_num; i++)
+        if (devices[i].dev == dev)
+            return &devices[i];
+    if (devices_num == MAX_DEVICES)
+        return NULL; // Not limited
+
+    device *new = &devices[devices_num++];
+    new->dev = dev;
+    new->active = 0;
+    new->limit = (is_rotational(dev) == 1) ? ROTATIONAL_THREADS : COPY_THREADS;
+    return new;
+}
+
+int is_rotational(dev_t dev)
+{
+    /* Partitions have no queue, the disk they belong to has one */
+    char path[PATH_MAX];
+    int rotational = 0;
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational", major(dev), minor(dev));
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/rotational", major(dev), minor(dev));
+        file = fopen(path, "r");
+    }
+    if (file != NULL)
+    {
+        if (fscanf(file, "%d", &rotational) != 1)
+            rotational = 0;
+        fclose(file);
+    }
+    return rotational;
+}
+
+void print_jobs()
+{
+    /* The oldest job is shown at the end of the status bar */
+    if (jobs == NULL)
+        return;
+    char buf[PATH_MAX];
+    get_job_progress(jobs, buf, sizeof(buf));
+    int len = strlen(buf) + ((jobs->next != NULL) ? 5 : 0);
+    if (len >= termsize_x)
+        return;
+    wattron(status_bar, COLOR_PAIR(2));
+    wmove(status_bar, 1, termsize_x - len - 1);
+    wclrtoeol(status_bar);
+    wprintw(status_bar, "%s%s", (jobs->next != NULL) ? "(+) " : "", buf);
+    wattroff(status_bar, COLOR_PAIR(2));
+}
+
+char *get_job_progress(job *job, char *buf, size_t size)
+{
+    char done_buf[16];
+    char total_buf[16];
+    char speed_buf[16];
+    long long files_done = __atomic_load_n(&job->files_done, __ATOMIC_RELAXED);
+    long long bytes_done = __atomic_load_n(&job->bytes_done, __ATOMIC_RELAXED);
+    long long files_total = __atomic_load_n(&job->files_total, __ATOMIC_RELAXED);
+    long long bytes_total = __atomic_load_n(&job->bytes_total, __ATOMIC_RELAXED);
+    long long removed = __atomic_load_n(&job->removed, __ATOMIC_RELAXED);
+    int phase = __atomic_load_n(&job->phase, __ATOMIC_RELAXED);
+    char *state = (__atomic_load_n(&job->paused, __ATOMIC_RELAXED) != 0) ? "  paused" : "";
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - job->start.tv_sec) + (now.tv_nsec - job->start.tv_nsec) / 1e9;
+    double speed = (elapsed > 0) ? bytes_done / elapsed : 0;
+    long eta = (speed > 0 && bytes_total > bytes_done) ? (bytes_total - bytes_done) / speed : 0;
+
+    if (phase == TASK_DELETE)
+        snprintf(buf, size, "[%s] removed %lld  %.0f/s%s", job_names[job->kind], removed,
+                 (elapsed > 0) ? removed / elapsed : 0, state);
+    else if (phase == TASK_SCAN)
+        snprintf(buf, size, "[%s] counting %lld files%s", job_names[job->kind], files_total, state);
+    else
+        snprintf(buf, size, "[%s %lld/%lld]  %s/%s  %s/s  ETA %ld:%02ld%s", job_names[job->kind],
+                 files_done, files_total, get_human_filesize(bytes_done, done_buf),
+                 get_human_filesize(bytes_total, total_buf), get_human_filesize(speed, speed_buf),
+                 eta / 60, eta % 60, state);
+    return buf;
+}
+
+void add_failure(job *job, const char *dir, const char *name, int error)
+{
+    int alloc_size = snprintf(NULL, 0, "%s%s%s: %s", dir, (name != NULL) ? "/" : "",
+                              (name != NULL) ? name : "", strerror(error));
+    char *buf = malloc(alloc_size + 1);
+    if (buf == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(buf, alloc_size + 1, "%s%s%s: %s", dir, (name != NULL) ? "/" : "",
+             (name != NULL) ? name : "", strerror(error));
+
+    pthread_mutex_lock(&job->lock);
+    if (job->failed_num == job->failed_cap)
+    {
+        job->failed_cap = job->failed_cap * 2 + 16;
+        job->failed = realloc(job->failed, job->failed_cap * sizeof(char *));
+        if (job->failed == NULL)
+        {
+            endwin();
+            perror("memory allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    job->failed[job->failed_num++] = buf;
+    pthread_mutex_unlock(&job->lock);
+}
+
+void print_failures(job *job, char *title)
+{
+    /* As many entries as the screen allows, like the bookmarks list */
+    int num = job->failed_num;
+    if (num > termsize_y - 6)
+        num = (termsize_y > 6) ? termsize_y - 6 : 1;
+    WINDOW *failures = create_window(num + 3, termsize_x, termsize_y - num - 4, 0);
+    wattron(failures, COLOR_PAIR(2));
+    wmove(failures, 1, 1);
+    if (num < job->failed_num)
+        wprintw(failures, "%s (%d, the first %d):", title, job->failed_num, num);
+    else
+        wprintw(failures, "%s (%d):", title, job->failed_num);
+    wattroff(failures, COLOR_PAIR(2));
+    for (int i = 0; i < num; i++)
+    {
+        wmove(failures, i + 2, 1);
+        waddnstr(failures, job->failed[i], termsize_x - 2);
+    }
+    box(failures, 0, 0);
+    wrefresh(failures);
+    read_key(failures);
+    close_window(failures);
+}
+
+void move_files(pane *pane)
+{
+    if (clipboard_num != 0)
+    {
+        /* The files from other devices are copied, then removed where they were */
+        job *job = new_job(TASK_MOVE);
+        int dirfd = open(pane->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        for (int i = 0; i < clipboard_set.len; i++)
+        {
+            char *buf = clipboard_set.paths[i];
+            if (buf != NULL)
+                mv_file(job, buf, dirfd, pane->path);
+        }
+        if (dirfd != -1)
+            close(dirfd);
+        clear_clipboard();
+        pane->select = 1;
+        invalidate_listings();
+        start_job(job);
+    }
+    else
+        print_notification("The clipboard is empty. Please select the files.");
+}
+
+int mv_file(job *job, char *path, int dirfd, char *dir)
+{
+    /* On the same file system the file only gets a new name */
+    char *name = strrchr(path, '/') + 1;
+    if (renameat2(AT_FDCWD, path, dirfd, name, RENAME_NOREPLACE) == 0)
+        return 0;
+    int error = errno;
+    int noreplace = 1;
+    struct stat src_st;
+    struct stat dst_st;
+    if (lstat(path, &src_st) == -1)
+        error = errno;
+    else if ((error == EEXIST || error == EINVAL) && S_ISDIR(src_st.st_mode) && is_inside(dirfd, &src_st) == 1)
+        error = EINVAL; // A directory moved into itself, nothing is backed up for it
+    else if (error == ENOSYS || error == EINVAL)
+    {
+        /* Without RENAME_NOREPLACE (NFS, FUSE, older kernels) the existing file is looked for first */
+        noreplace = 0;
+        if (fstatat(dirfd, name, &dst_st, AT_SYMLINK_NOFOLLOW) == 0)
+            error = EEXIST;
+        else if (errno != ENOENT)
+            error = errno;
+        else if (renameat(AT_FDCWD, path, dirfd, name) == 0)
+            return 0;
+        else
+            error = errno;
+    }
+    else if (error == EEXIST && fstatat(dirfd, name, &dst_st, AT_SYMLINK_NOFOLLOW) == -1)
+        error = errno;
+
+    /* Keep the existing file as name~ like mv -b does, a directory and a file do not replace each other */
+    if (error == EEXIST && (src_st.st_dev != dst_st.st_dev || src_st.st_ino != dst_st.st_ino))
+    {
+        if (S_ISDIR(src_st.st_mode) != S_ISDIR(dst_st.st_mode))
+            error = S_ISDIR(dst_st.st_mode) ? EISDIR : ENOTDIR;
+        else if (backup_file(dirfd, name) == -1)
+            error = errno;
+        else if (((noreplace == 1) ? renameat2(AT_FDCWD, path, dirfd, name, RENAME_NOREPLACE) :
+                  renameat(AT_FDCWD, path, dirfd, name)) == 0)
+            return 0;
+        else
+            error = errno;
+    }
+
+    if (error == EXDEV && cp_file(job, path, dir) == 0)
+        return 0;
+    add_failure(job, path, NULL, error);
+    return -1;
+}
+
+int is_inside(int dirfd, const struct stat *st)
+{
+    /* 1 if the directory is the given one or below it, the parents are followed up to the root */
+    struct stat dir_st;
+    ino_t last_ino = 0;
+    dev_t last_dev = 0;
+    int fd = dup(dirfd);
+    while (fd != -1 && fstat(fd, &dir_st) == 0 && (dir_st.st_ino != last_ino || dir_st.st_dev != last_dev))
+    {
+        if (dir_st.st_dev == st->st_dev && dir_st.st_ino == st->st_ino)
+        {
+            close(fd);
+            return 1;
+        }
+        last_ino = dir_st.st_ino;
+        last_dev = dir_st.st_dev;
+        int parent = openat(fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        close(fd);
+        fd = parent;
+    }
+    if (fd != -1)
+        close(fd);
+    return 0;
+}
+
+void rename_file(pane *pane)
+{
+    char *new_name = malloc(NAME_MAX);
+    if (new_name == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    echo();
+    curs_set(1);
+    wgetnstr(status_bar, new_name, NAME_MAX);
+    noecho();
+    curs_set(0);
+    if (strlen(new_name) != 0 && is_empty_str(new_name) != 0)
+    { if (access(pane->select_path, W_OK) == 0)
+        {
+            int alloc_size = snprintf(NULL, 0, "%s/%s", pane->path, new_name);
+            char *new_path = malloc(alloc_size + 1);
+            if (new_path == NULL)
+            {
+                endwin();
+                perror("memory allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+            snprintf(new_path, alloc_size + 1, "%s/%s", pane->path, new_name);
+            char *argv[] = { "mv", "-b", pane->select_path, new_path, (char *)0 };
+            pid_t pid = fork_exec(argv[0], argv);
+            int status;
+            waitpid(pid, &status, 0);
+            free(new_path);
+            pane->select = 1;
+            invalidate_listings();
+        }
+        else
+            print_notification("Permission denied!");
+    }
+    else
+        print_notification("Please enter the correct name!");
+    free(new_name);
+}
+
+int is_empty_str(const char *str)
+{
+    while (*str != '\0')
+    {
+        if (isspace((unsigned char) *str) == 0)
+            return -1;
+        str++;
+    }
+    return 0;
+}
+
+void open_shell(pane *pane)
+{
+    save_clipboard(); // The clipboard file can be used from the shell
+    endwin();
+    sigprocmask(SIG_BLOCK, &signal_set, NULL); // block SIGWINCH
+    pid_t pid;
+    pid = fork();
+    if (pid == -1)
+    {
+        endwin();
+        perror("fork error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        chdir(pane->path);
+        char *cmd[] = { shell, (char *)0 };
+        execvp(cmd[0], cmd);
+        perror("EXEC:\n");
+        exit(EXIT_FAILURE);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+
+    /* refresh */
+    left_pane.select = 1;
+    right_pane.select = 1;
+    left_pane.top_index = 0;
+    right_pane.top_index = 0;
+    invalidate_listings();
+    refresh();
+}
+
+void select_all(pane *pane)
+{
+    clear_clipboard();
+    for (int index = 0; index < pane->dirs_num + pane->files_num; index++)
+    {
+        char *filepath = get_select_path(index, pane);
+        append_clipboard(filepath);
+        free(filepath);
+    }
+}
+
+void make_new(pane *pane, char *cmd)
+{
+    char *new = malloc(NAME_MAX);
+    if (new == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    echo();
+    curs_set(1);
+    wgetnstr(status_bar, new, NAME_MAX);
+    noecho();
+    curs_set(0);
+    if (strlen(new) != 0 && is_empty_str(new) != 0)
+    {
+        if (access(pane->path, W_OK) == 0)
+        {
+            int alloc_size = snprintf(NULL, 0, "%s/%s", pane->path, new);
+            char *new_path = malloc(alloc_size + 1);
+            if (new_path == NULL)
+            {
+                endwin();
+                perror("memory allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+            snprintf(new_path, alloc_size + 1, "%s/%s", pane->path, new);
+            if (access(new_path, R_OK) != 0)
+            {
+                char *argv[] = { cmd, new_path, (char *)0 };
+                pid_t pid = fork_exec(argv[0], argv);
+                int status;
+                waitpid(pid, &status, 0);
+                free(new_path);
+                pane->select = 1;
+                invalidate_listings();
+            }
+            else
+                print_notification("File/directory exists!");
+        }
+        else
+            print_notification("Permission denied!");
+    }
+    else
+        print_notification("Please enter the correct name!");
+    free(new);
+}
+
+void print_preview(pane *pane, struct pane *active)
+{
+    /* The worker reads the selected file, the pane shows what is ready */
+    if (active->select_path != NULL && (preview_path == NULL || strcmp(preview_path, active->select_path) != 0))
+    {
+        free(preview_path);
+        preview_path = strdup(active->select_path);
+        if (preview_path == NULL)
+        {
+            endwin();
+            perror("memory allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        request_preview(preview_path);
+        pane->redraw = 1;
+    }
+    if (pane->redraw == 0)
+        return;
+
+    int width = getmaxx(pane->win) - 3; // The last column is under the other pane
+    int line_pos = 1;
+    pthread_mutex_lock(&preview_lock);
+    preview *p = (preview_path != NULL) ? find_preview(preview_path) : NULL;
+    if (p != NULL && (p->error != 0 || (p->is_dir == 0 && p->text == NULL)))
+    {
+        char buf[16];
+        wmove(pane->win, line_pos, 0);
+        wclrtoeol(pane->win);
+        if (p->error != 0)
+            mvwprintw(pane->win, line_pos++, 2, "%s", strerror(p->error));
+        else
+            mvwprintw(pane->win, line_pos++, 2, "Binary file, %s", get_human_filesize(p->size, buf));
+    }
+    else if (p != NULL && p->is_dir == 1)
+    {
+        for (int i = 0; i < p->list.num && line_pos < termsize_y - 1; i++)
+        {
+            char *name = entry_name(&p->list, i);
+            if (hide_flag == 0 && name[0] == '.')
+                continue;
+            int color = (p->list.entries[i].type == DT_DIR) ? 1 : 0;
+            wmove(pane->win, line_pos, 0);
+            wclrtoeol(pane->win);
+            wattron(pane->win, COLOR_PAIR(color) | ((color == 1) ? A_BOLD : 0));
+            mvwaddnstr(pane->win, line_pos++, 2, name, width);
+            wattroff(pane->win, COLOR_PAIR(color) | A_BOLD);
+        }
+    }
+    else if (p != NULL)
+    {
+        for (char *line = p->text; *line != '\0' && line_pos < termsize_y - 1; )
+        {
+            char *end = strchr(line, '\n');
+            int len = (end != NULL) ? end - line : (int) strlen(line);
+            int n = (len < width) ? len : width;
+            while (n > 0 && n < len && (line[n] & 0xC0) == 0x80)
+                n--; // Not in the middle of a character
+            wmove(pane->win, line_pos, 0);
+            wclrtoeol(pane->win);
+            mvwaddnstr(pane->win, line_pos++, 2, line, n);
+            line += (end != NULL) ? len + 1 : len;
+        }
+    }
+    pthread_mutex_unlock(&preview_lock);
+
+    /* The rest of the pane is cleared, the lines of the files are printed again later */
+    for (; line_pos < termsize_y - 1; line_pos++)
+    {
+        wmove(pane->win, line_pos, 0);
+        wclrtoeol(pane->win);
+    }
+    touchline(active->win, 1, termsize_y - 2); // The panes overlap by one column
+    for (int i = 0; i < termsize_y; i++)
+        pane->rows[i] = -2;
+    pane->redraw = 0;
+}
+
+void request_preview(const char *path)
+{
+    /* Only the last request is kept, the file being read is not needed any more */
+    char *copy = strdup(path);
+    if (copy == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&preview_lock);
+    free(preview_request);
+    preview_request = copy;
+    __atomic_store_n(&preview_cancel, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&preview_cond);
+    pthread_mutex_unlock(&preview_lock);
+
+    if (preview_started == 0)
+    {
+        pthread_t thread;
+        sigset_t old_set;
+        pthread_sigmask(SIG_BLOCK, &signal_set, &old_set);
+        if (pthread_create(&thread, NULL, run_previewer, NULL) == 0)
+        {
+            pthread_detach(thread);
+            preview_started = 1;
+        }
+        pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    }
+}
+
+void *run_previewer(void *arg)
+{
+    (void) arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&preview_lock);
+        while (preview_request == NULL)
+            pthread_cond_wait(&preview_cond, &preview_lock);
+        char *path = preview_request;
+        preview_request = NULL;
+        __atomic_store_n(&preview_cancel, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&preview_lock);
+
+        /* A cached preview is used while the file has the same size and time */
+        struct stat st;
+        int ret = stat(path, &st);
+        pthread_mutex_lock(&preview_lock);
+        preview *p = find_preview(path);
+        int fresh = p != NULL && ret == 0 && p->error == 0 && p->size == st.st_size &&
+                    p->mtime.tv_sec == st.st_mtim.tv_sec && p->mtime.tv_nsec == st.st_mtim.tv_nsec;
+        pthread_mutex_unlock(&preview_lock);
+        if (fresh == 0)
+        {
+            p = read_preview(path, (ret == 0) ? &st : NULL);
+            if (p != NULL)
+            {
+                pthread_mutex_lock(&preview_lock);
+                store_preview(p);
+                pthread_mutex_unlock(&preview_lock);
+            }
+        }
+        free(path);
+        if (write(meta_pipe[1], "", 1) == -1 && errno != EAGAIN)
+            continue; // The UI is woken up by the bytes already in the pipe
+    }
+    return NULL;
+}
+
+preview *read_preview(const char *path, struct stat *st)
+{
+    preview *p = calloc(1, sizeof(preview));
+    if (p == NULL || (p->path = strdup(path)) == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (st == NULL)
+    {
+        p->error = errno;
+        return p;
+    }
+    p->mtime = st->st_mtim;
+    p->size = st->st_size;
+
+    /* A directory is listed as in the panes */
+    if (S_ISDIR(st->st_mode))
+    {
+        p->is_dir = 1;
+        if (read_listing(&p->list, path, &preview_cancel, NULL) == -1)
+            p->error = errno;
+        else if (__atomic_load_n(&preview_cancel, __ATOMIC_RELAXED) == 0)
+            sort_listing(&p->list);
+        if (__atomic_load_n(&preview_cancel, __ATOMIC_RELAXED) == 1)
+        {
+            free_preview(p); // The cursor has moved on
+            return NULL;
+        }
+        return p;
+    }
+
+    /* The head of a file, a special file is not read */
+    char buf[PREVIEW_SIZE];
+    ssize_t len = 0;
+    int fd = -1;
+    if (S_ISREG(st->st_mode) && (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+        p->error = errno;
+    else if (fd != -1)
+    {
+        len = pread(fd, buf, sizeof(buf), 0);
+        if (len == -1)
+            p->error = errno;
+        close(fd);
+    }
+    if (p->error != 0 || memchr(buf, '\0', (len > 0) ? len : 0) != NULL)
+        return p; // The text is NULL for a binary file
+
+    /* Tabs are expanded, control characters are not printed */
+    p->text = malloc(len * 8 + 1);
+    if (p->text == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t pos = 0;
+    size_t column = 0;
+    for (ssize_t i = 0; i < len; i++)
+    {
+        unsigned char c = buf[i];
+        if (c == '\t')
+        {
+            do
+                p->text[pos++] = ' ';
+            while (++column % 8 != 0);
+            continue;
+        }
+        if (c == '\r')
+            continue;
+        if (c == '\n')
+            column = 0;
+        else
+            column++;
+        p->text[pos++] = (c < ' ' && c != '\n') || c == 0x7f ? '?' : c;
+    }
+    p->text[pos] = '\0';
+    return p;
+}
+
+preview *find_preview(const char *path)
+{
+    /* The found preview becomes the most recently used one */
+    for (int i = 0; i < PREVIEW_CACHE && previews[i] != NULL; i++)
+    {
+        if (strcmp(previews[i]->path, path) == 0)
+        {
+            preview *p = previews[i];
+            memmove(&previews[1], &previews[0], i * sizeof(preview *));
+            previews[0] = p;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+void store_preview(preview *p)
+{
+    /* Replaces the old preview of the file, or the least recently used one */
+    int i = 0;
+    while (i < PREVIEW_CACHE - 1 && previews[i] != NULL && strcmp(previews[i]->path, p->path) != 0)
+        i++;
+    if (previews[i] != NULL)
+        free_preview(previews[i]);
+    memmove(&previews[1], &previews[0], i * sizeof(preview *));
+    previews[0] = p;
+}
+
+void free_preview(preview *p)
+{
+    free_listing(&p->list);
+    free(p->text);
+    free(p->path);
+    free(p);
+}
+
+int get_bookmarks_num()
+{
+    int num = 0;
+    FILE *file = fopen(bookmarks_path, "r");
+    if (file != NULL)
+    {
+        char buf[PATH_MAX];
+        while(fgets(buf, PATH_MAX, file))
+            num++;
+        fclose(file);
+        return num;
+    }
+    return -1;
+}
+
+int exist_bookmark(char key)
+{
+    FILE *file = fopen(bookmarks_path, "r");
+    if (file != NULL)
+    {
+        char buf[PATH_MAX];
+        while(fgets(buf, PATH_MAX, file))
+        {
+            if (buf[0] == key)
+            {
+                fclose(file);
+                return 0;
+            }
+        }
+        fclose(file);
+    }
+    return -1;
+}
+
+void add_bookmark(char *path, char key)
+{
+    FILE *file = fopen(bookmarks_path, "a+");
+    if (file == NULL)
+    {
+        endwin();
+        perror("bookmarks access error\n");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(file, "%c:%s\n", key, path);
+    fclose(file);
+}
+
+void print_bookmarks()
+{
+    int i = 0;
+    char buf[PATH_MAX];
+    FILE *file = fopen(bookmarks_path, "r");
+    if (file == NULL)
+    {
+        endwin();
+        perror("bookmarks access error\n");
+        exit(EXIT_FAILURE);
+    }
+    bookmarks = create_window(bookmarks_num + 3, termsize_x, termsize_y - bookmarks_num - 4, 0);
+    wattron(bookmarks, COLOR_PAIR(2));
+    wmove(bookmarks, 1, 1);
+    wprintw(bookmarks, "mark\tpath\n");
+    wattroff(bookmarks, COLOR_PAIR(2));
+    while(fgets(buf, PATH_MAX, file))
+    {
+        wmove(bookmarks, i + 2, 1);
+        wprintw(bookmarks, " %c", buf[0]);
+        wprintw(bookmarks, "\t%s", &buf[2]);
+        i++;
+    }
+    fclose(file);
+    box(bookmarks, 0, 0);
+    wrefresh(bookmarks);
+}
+
+void open_bookmark(char key, pane *pane)
+{
+    FILE *file = fopen(bookmarks_path, "r");
+    if (file == NULL)
+    {
+        endwin();
+        perror("bookmarks access error\n");
+        exit(EXIT_FAILURE);
+    }
+    char buf[PATH_MAX];
+    while(fgets(buf, PATH_MAX, file))
+    {
+        if (buf[0] == key)
+        {
+            buf[strcspn(buf, "\r\n")] = 0;
+            int alloc_size = snprintf(NULL, 0, "%s", buf);
+            char *new_path = malloc(alloc_size + 1);
+            if (new_path == NULL)
+            {
+                endwin();
+                perror("memory allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+            strncpy(new_path, buf + 2, strlen(buf) - 1);
+
+            if (access(new_path, R_OK) == 0)
+            {
+                free(pane->path);
+                alloc_size = snprintf(NULL, 0, "%s", new_path);
+                pane->path = malloc(alloc_size + 1);
+                if (pane->path == NULL)
+                {
+                    endwin();
+                    perror("memory allocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+                snprintf(pane->path, alloc_size + 1, "%s", new_path);
+
+                pane->list_dirty = 1;
+                pane->select = 1;
+                pane->top_index = 0;
+                /* If the directory is empty */
+                alloc_size = snprintf(NULL, 0, "%s", pane->path);
+                free(pane->select_path);
+                pane->select_path = malloc(alloc_size + 1);
+                if (pane->select_path == NULL)
+                {
+                    perror("memory allocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+                snprintf(pane->select_path, alloc_size + 1, "%s", pane->path);
+            }
+            else
+                print_notification("The directory doesn't exist.");
+            free(new_path);
+            break;
+        }
+    }
+    fclose(file);
+}
+
+void remove_bookmark(char key)
+{
+    FILE *file = fopen(bookmarks_path, "r");
+    if (file != NULL)
+    {
+        char *tmp_bookmarks_path = NULL;
+        int alloc_size = snprintf(NULL, 0, "%s/.bookmarks", conf_path);
+        tmp_bookmarks_path = malloc(alloc_size + 1);
+        if (tmp_bookmarks_path == NULL)
+        {
+            endwin();
+            perror("temp bookmarks initialization error\n");
+            exit(EXIT_FAILURE);
+        }
+        snprintf(tmp_bookmarks_path, alloc_size + 1, "%s/.bookmarks", conf_path);
+
+        char buf[PATH_MAX];
+        FILE *tmp_file = fopen(tmp_bookmarks_path, "a+");
+        if (tmp_file == NULL)
+        {
+            endwin();
+            perror("temp bookmarks access error\n");
+            exit(EXIT_FAILURE);
+        }
+        while (fgets(buf, PATH_MAX, file))
+        {
+            buf[strcspn(buf, "\r\n")] = 0;
+            if (buf[0] != key)
+                fprintf(tmp_file, "%s\n", buf);
+            else
+                print_notification("Bookmark deleted.");
+        }
+
+        fclose(tmp_file);
+        fclose(file);
+        char *argv[] = { "mv", tmp_bookmarks_path, bookmarks_path, (char *)0 };
+        pid_t pid = fork_exec(argv[0], argv);
+        int status;
+        waitpid(pid, &status, 0);
+        free(tmp_bookmarks_path);
+    }
+}
+
+void search_as_you_type(pane *pane)
 {
-    free(pane->parent_dirname);
-    char *ptr = strrchr(pane->path, '/');
-    int alloc_size = snprintf(NULL, 0, "%s", ptr);
-    pane->parent_dirname = malloc(alloc_size + 1);
-    if (pane->parent_dirname == NULL)
+    /* The cursor moves to the first match while the string is typed */
+    char substr[NAME_MAX + 1] = "";
+    size_t len = 0;
+    int top_index = pane->top_index;
+    int select = pane->select;
+    int start = top_index + select - 1;
+    int key;
+    left_pane.matches_ok = 0; // The matches of the previous string
+    right_pane.matches_ok = 0;
+    curs_set(1);
+    for (;;)
     {
-        endwin();
-        perror("memory allocation error\n");
-        exit(EXIT_FAILURE);
+        wmove(status_bar, 1, 0);
+        wclrtoeol(status_bar);
+        wattron(status_bar, COLOR_PAIR(2));
+        mvwprintw(status_bar, 1, 2, "Search: ");
+        wattroff(status_bar, COLOR_PAIR(2));
+        wprintw(status_bar, "%s", substr);
+        print_files(pane);
+        wnoutrefresh(pane->win);
+        wnoutrefresh(status_bar);
+        doupdate();
+
+        key = read_key(status_bar);
+        if (key == KEY_RETURN || key == 27) // 27: Escape
+            break;
+        if (key == 127 || key == 8 || key == KEY_BACKSPACE)
+        {
+            if (len == 0)
+                continue;
+            substr[--len] = '\0';
+            pane->matches_ok = 0; // A shorter string matches more files
+        }
+        else if (key >= ' ' && key < 256 && len < NAME_MAX)
+        {
+            substr[len++] = key;
+            substr[len] = '\0';
+            if (pane->matches_ok == 1)
+                refine_matches(pane, substr); // Only the matches of the shorter string can match
+        }
+        else
+            continue;
+
+        if (len == 0)
+        {
+            pane->top_index = top_index;
+            pane->select = select;
+            continue;
+        }
+        if (pane->matches_ok == 0)
+            search_matches(pane, substr);
+        if (pane->matches_num != 0)
+        {
+            /* The first match from the file the search started on */
+            int low = 0;
+            int high = pane->matches_num;
+            while (low < high)
+            {
+                int mid = (low + high) / 2;
+                if (pane->matches[mid] < start)
+                    low = mid + 1;
+                else
+                    high = mid;
+            }
+            pane->match_pos = (low < pane->matches_num) ? low : 0;
+            go_to_index(pane, pane->matches[pane->match_pos]);
+        }
+        else
+        {
+            pane->top_index = top_index; // Back to where the search started
+            pane->select = select;
+        }
     }
-    snprintf(pane->parent_dirname, alloc_size + 1, "%s", ptr + 1);
+    curs_set(0);
 
-    pane->path[strrchr(pane->path, '/') - pane->path] = '\0';
-    if (pane->path[0] == '\0') // For root dir
+    if (key == 27 || len == 0 || is_empty_str(substr) == 0)
     {
-        pane->path[0] = '/';
-        pane->path[1] = '\0';
+        pane->top_index = top_index;
+        pane->select = select;
+        if (key != 27)
+            print_notification("Please enter the correct name!");
+        return;
     }
-
-    back_flag = 1;
-}
-
-int is_dir(const char *path)
-{
-    struct stat st;
-    stat(path, &st);
-    return S_ISDIR(st.st_mode); // Returns non-zero if the file is a directory
-}
-
-void open_dir(pane *pane)
-{
-    free(pane->path);
-    int alloc_size = snprintf(NULL, 0, "%s", pane->select_path);
-    pane->path = malloc(alloc_size + 1);
-    if (pane->path == NULL)
+    free(search_substr);
+    search_substr = strdup(substr);
+    if (search_substr == NULL)
     {
         endwin();
         perror("memory allocation error\n");
         exit(EXIT_FAILURE);
     }
-    snprintf(pane->path, alloc_size + 1, "%s", pane->select_path);
-
-    pane->select = 1;
-    pane->top_index = 0;
 }
 
-void open_file(pane *pane)
+void search_matches(pane *pane, const char *substr)
 {
-    magic_t magic = magic_open(MAGIC_MIME_TYPE);
-    magic_load(magic, NULL);
-    const char *filetype = magic_file(magic, pane->select_path);
-    if (filetype != NULL)
+    /* One pass over the folded names of the view finds all matches */
+    listing *list = &pane->list;
+    if (list->folded == NULL)
+        build_search_index(list);
+    char needle[NAME_MAX + 1];
+    size_t len = strlen(substr);
+    fold_case(needle, substr, len);
+
+    pane->matches_num = 0;
+    pane->matches_ok = 1;
+    pane->match_pos = 0;
+    size_t end = list->folded_starts[list->view_num];
+    size_t pos = 0;
+    const char *found;
+    while (pos < end && (found = find_substr(list->folded + pos, end - pos, needle, len)) != NULL)
     {
-        if (strstr(filetype, "text/")     != NULL ||
-            strstr(filetype, "empty")     != NULL ||
-            strstr(filetype, "sharedlib") != NULL ||
-            strstr(filetype, "/zip")      != NULL ||
-            strstr(filetype, "symlink")   != NULL ||
-            strstr(filetype, "octet")     != NULL)
+        /* The file the match is in, the rest of its name is skipped */
+        size_t offset = found - list->folded;
+        int low = 0;
+        int high = list->view_num - 1;
+        while (low < high)
         {
-            /* Open a file in default text editor */
-            endwin();
-            sigprocmask(SIG_BLOCK, &signal_set, NULL); // block SIGWINCH
-            char *argv[] = { editor, pane->select_path, (char *)0 };
-            pid_t pid = fork_exec(argv[0], argv);
-            int status;
-            waitpid(pid, &status, 0);
+            int mid = (low + high + 1) / 2;
+            if ((size_t) list->folded_starts[mid] <= offset)
+                low = mid;
+            else
+                high = mid - 1;
         }
-        else
+        if (pane->matches_num % 256 == 0)
         {
-            /* Open a file in the user's preferred application */
-            char *argv[] = { "xdg-open", pane->select_path, (char *)0 };
-            fork_exec(argv[0], argv);
+            pane->matches = realloc(pane->matches, (pane->matches_num + 256) * sizeof(int));
+            if (pane->matches == NULL)
+            {
+                endwin();
+                perror("memory allocation error\n");
+                exit(EXIT_FAILURE);
+            }
         }
+        pane->matches[pane->matches_num++] = low;
+        pos = list->folded_starts[low + 1];
     }
-    else
-        perror("an magic_error occurred:\n");
-    magic_close(magic);
 }
 
-pid_t fork_exec(char *cmd, char **argv)
+void refine_matches(pane *pane, const char *substr)
 {
-    pid_t pid;
-    pid = fork();
-    if (pid == -1)
-    {
-        endwin();
-        perror("fork error\n");
-        exit(EXIT_FAILURE);
-    }
-    if (pid == 0)
+    /* The matches of a longer string are among the matches of its beginning */
+    listing *list = &pane->list;
+    char needle[NAME_MAX + 1];
+    size_t len = strlen(substr);
+    fold_case(needle, substr, len);
+    int num = 0;
+    for (int i = 0; i < pane->matches_num; i++)
     {
-        int fd = open("/dev/null", O_WRONLY);
-        dup2(fd, STDERR_FILENO);
-        close(fd); // Stderr now write to /dev/null
-        execvp(cmd, argv);
-        perror("EXEC:\n");
-        exit(EXIT_FAILURE);
+        int index = pane->matches[i];
+        size_t start = list->folded_starts[index];
+        if (find_substr(list->folded + start, list->folded_starts[index + 1] - start, needle, len) != NULL)
+            pane->matches[num++] = index;
     }
-    return pid;
+    pane->matches_num = num;
+    pane->match_pos = 0;
 }
 
-void highlight_active_pane(int y, int x)
+void go_to_match(pane *pane, int forward)
 {
-    wattron(status_bar, COLOR_PAIR(2));
-    mvwhline(status_bar, y, x, ACS_HLINE, termsize_x / 2);
-    wattroff(status_bar, COLOR_PAIR(2));
+    if (search_substr == NULL)
+        return;
+    if (pane->matches_ok == 0)
+        search_matches(pane, search_substr);
+    if (pane->matches_num == 0)
+        return;
+
+    /* The next match follows the last one, otherwise it is searched from the cursor */
+    int current = pane->top_index + pane->select - 1;
+    int pos;
+    if (pane->match_pos < pane->matches_num && pane->matches[pane->match_pos] == current)
+        pos = pane->match_pos + ((forward == 1) ? 1 : -1);
+    else
+    {
+        int low = 0;
+        int high = pane->matches_num;
+        while (low < high)
+        {
+            int mid = (low + high) / 2;
+            if (pane->matches[mid] <= current)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        pos = (forward == 1) ? low : low - 1;
+        if (forward == 0 && low > 0 && pane->matches[low - 1] == current)
+            pos = low - 2;
+    }
+    if (pos >= pane->matches_num)
+        pos = 0; // Wrap around
+    else if (pos < 0)
+        pos = pane->matches_num - 1;
+    pane->match_pos = pos;
+    go_to_index(pane, pane->matches[pos]);
 }
 
-void print_status(pane *pane)
+void go_to_index(pane *pane, int index)
 {
     int num = pane->dirs_num + pane->files_num;
-    int file_number = 0;
-    if (num != 0)
-        file_number = pane->top_index + pane->select;
-    if (is_dir(pane->select_path) == 0)
+    if (termsize_y > num)
     {
-        char buf[10];
-        struct stat st;
-        double size = (stat(pane->select_path, &st) == 0) ? st.st_size : 0;
-        char *human_size = get_human_filesize(size, buf);
-        wmove(status_bar, 1, 0);
-        wprintw(status_bar, "[%02d/%02d]  [*%d]  %s  %s", file_number, num, clipboard_num,
-                human_size, pane->select_path);
+        pane->top_index = 0;
+        pane->select = index + 1;
+    }
+    else if (index < num - (termsize_y - 2))
+    {
+        pane->top_index = index;
+        pane->select = 1;
     }
     else
     {
-        wmove(status_bar, 1, 0);
-        wprintw(status_bar, "[%02d/%02d]  [*%d]  %s", file_number, num, clipboard_num,
-                pane->select_path);
+        pane->top_index = num - (termsize_y - 2);
+        pane->select = termsize_y - 1 - (num - index);
     }
 }
 
-void print_notification(char *str)
+void build_search_index(listing *list)
 {
-    wattron(status_bar, COLOR_PAIR(2));
-    wattron(status_bar, A_BOLD);
-    print_line(status_bar, 1, str);
-    wattroff(status_bar, COLOR_PAIR(2));
-    wattroff(status_bar, A_BOLD);
-    wrefresh(status_bar);
-    usleep(1000000);
+    size_t size = 0;
+    for (int i = 0; i < list->view_num; i++)
+        size += list->entries[list->view[i]].name_len + 1;
+    list->folded = malloc(size + 1);
+    list->folded_starts = malloc((list->view_num + 1) * sizeof(int));
+    count_stats(&frame_stats.allocs, 2);
+    if (list->folded == NULL || list->folded_starts == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t pos = 0;
+    for (int i = 0; i < list->view_num; i++)
+    {
+        entry *e = &list->entries[list->view[i]];
+        list->folded_starts[i] = pos;
+        fold_case(list->folded + pos, list->names + e->name_off, e->name_len);
+        pos += e->name_len + 1; // The '\0' keeps the matches inside the names
+    }
+    list->folded_starts[list->view_num] = pos;
 }
 
-char *get_human_filesize(double size, char *buf)
+void fold_case(char *dst, const char *src, size_t len)
 {
-    const char *units[] = {"B", "kB", "MB", "GB", "TB", "PB"};
-    int i = 0;
-    while (size > 1024)
+    /* As strcasestr did, only the ASCII letters */
+    for (size_t i = 0; i < len; i++)
+        dst[i] = (src[i] >= 'A' && src[i] <= 'Z') ? src[i] + 'a' - 'A' : src[i];
+    dst[len] = '\0';
+}
+
+const char *find_substr(const char *hay, size_t len, const char *needle, size_t needle_len)
+{
+    /* The widest kernel the processor has, chosen on the first call */
+    static const char *(*kernel)(const char *, size_t, const char *, size_t) = NULL;
+    if (kernel == NULL)
     {
-        size /= 1024;
-        i++;
+#if defined(__x86_64__)
+        kernel = (__builtin_cpu_supports("avx2")) ? find_substr_avx2 : find_substr_sse2;
+#else
+        kernel = find_substr_sse2;
+#endif
     }
-    sprintf(buf, "%.*f %s", i, size, units[i]);
-    return buf;
+    if (needle_len == 0)
+        return hay;
+    if (needle_len > len)
+        return NULL;
+    return kernel(hay, len, needle, needle_len);
 }
 
-int exist_clipboard(char *path)
+#if defined(__x86_64__)
+const char *find_substr_sse2(const char *hay, size_t len, const char *needle, size_t needle_len)
 {
-    FILE *file = fopen(clipboard_path, "r");
-    if (file != NULL)
+    /* The first and the last byte of the needle are compared at 16 positions at once */
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    size_t i = 0;
+    for (; i + needle_len - 1 + 16 <= len; i += 16)
     {
-        char buf[PATH_MAX];
-        while(fgets(buf, PATH_MAX, file))
+        __m128i block_first = _mm_loadu_si128((const __m128i *) (hay + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *) (hay + i + needle_len - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                                                        _mm_cmpeq_epi8(block_last, last)));
+        while (mask != 0)
         {
-            buf[strcspn(buf, "\r\n")] = 0;
-            if (strcmp(path, buf) == 0)
-            {
-                fclose(file);
-                return 0;
-            }
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, needle_len - 1) == 0)
+                return hay + i + bit;
+            mask &= mask - 1;
         }
-        fclose(file);
     }
-    return -1;
+    return memmem(hay + i, len - i, needle, needle_len); // The tail
 }
 
-void append_clipboard(char *path)
+__attribute__((target("avx2")))
+const char *find_substr_avx2(const char *hay, size_t len, const char *needle, size_t needle_len)
 {
-    FILE *file = fopen(clipboard_path, "a+");
-    if (file == NULL)
+    /* As find_substr_sse2, at 32 positions */
+    __m256i first = _mm256_set1_epi8(needle[0]);
+    __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+    size_t i = 0;
+    for (; i + needle_len - 1 + 32 <= len; i += 32)
     {
-        endwin();
-        perror("clipboard access error\n");
-        exit(EXIT_FAILURE);
+        __m256i block_first = _mm256_loadu_si256((const __m256i *) (hay + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *) (hay + i + needle_len - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+                                                              _mm256_cmpeq_epi8(block_last, last)));
+        while (mask != 0)
+        {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, needle_len - 1) == 0)
+                return hay + i + bit;
+            mask &= mask - 1;
+        }
     }
-    fprintf(file, "%s\n", path);
-    clipboard_num++;
-    fclose(file);
+    return memmem(hay + i, len - i, needle, needle_len);
+}
+#else
+const char *find_substr_sse2(const char *hay, size_t len, const char *needle, size_t needle_len)
+{
+    return memmem(hay, len, needle, needle_len); // No vector kernel for this processor
 }
+#endif
 
-void remove_clipboard(char *path)
+void find_files(pane *pane)
 {
-    FILE *file = fopen(clipboard_path, "r");
-    if (file != NULL)
+    /* The results are scored while the walk goes on and the query is typed */
+    if (termsize_y < 5 || termsize_x < 20)
+        return; // No room for the prompt and a result
+    finder *finder = start_finder(pane->path);
+    char query[NAME_MAX + 1] = "";
+    int len = 0;
+    fuzzy_match *matches = NULL;
+    int matches_num = 0;
+    int matches_cap = 0;
+    int scored = 0; // The results already scored against the query
+    int selected = 0;
+    int changed = 1;
+    int key = ERR;
+    int height = termsize_y - 1;
+    fuzzy_match top[height];
+    int top_num = 0;
+    WINDOW *win = create_window(height, termsize_x, 0, 0);
+    keypad(win, TRUE);
+    curs_set(1);
+
+    for (;;)
     {
-        char *tmp_clipboard_path = NULL;
-        int alloc_size = snprintf(NULL, 0, "%s/.clipboard", conf_path);
-        tmp_clipboard_path = malloc(alloc_size + 1);
-        if (tmp_clipboard_path == NULL)
+        /* A slice of the new results, the keyboard is checked between the slices */
+        int num = __atomic_load_n(&finder->num, __ATOMIC_ACQUIRE);
+        int end = (num - scored > FINDER_SLICE) ? scored + FINDER_SLICE : num;
+        for (; len != 0 && scored < end; scored++)
         {
-            endwin();
-            perror("temp clipboard initialization error\n");
-            exit(EXIT_FAILURE);
+            int score = fuzzy_score(finder->results[scored], query, len);
+            if (score == INT_MIN)
+                continue;
+            if (matches_num == matches_cap)
+            {
+                matches_cap = matches_cap * 2 + 4096;
+                matches = realloc(matches, matches_cap * sizeof(fuzzy_match));
+                if (matches == NULL)
+                {
+                    endwin();
+                    perror("memory allocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            matches[matches_num++] = (fuzzy_match) { scored, score };
+            changed = 1;
         }
-        snprintf(tmp_clipboard_path, alloc_size + 1, "%s/.clipboard", conf_path);
-
-        char buf[PATH_MAX];
-        FILE *tmp_file = fopen(tmp_clipboard_path, "a+");
-        if (tmp_file == NULL)
+        if (len == 0)
         {
-            endwin();
-            perror("temp clipboard access error\n");
-            exit(EXIT_FAILURE);
+            changed |= scored != num;
+            scored = num;
         }
-        while (fgets(buf, PATH_MAX, file))
+
+        int walking = __atomic_load_n(&finder->pending, __ATOMIC_ACQUIRE) != 0;
+        if (changed == 1 || walking == 1)
         {
-            buf[strcspn(buf, "\r\n")] = 0;
-            if (strcmp(path, buf) != 0)
-                fprintf(tmp_file, "%s\n", buf);
+            if (len == 0)
+            {
+                /* Without a query, the files in the order they were found */
+                top_num = (num < height - 3) ? num : height - 3;
+                for (int i = 0; i < top_num; i++)
+                    top[i] = (fuzzy_match) { i, 0 };
+            }
             else
-                clipboard_num--;
+                top_num = get_top_matches(matches, matches_num, top, height - 3);
+            if (selected >= top_num)
+                selected = (top_num > 0) ? top_num - 1 : 0;
+            print_finder(win, finder, query, top, top_num, selected, (len == 0) ? num : matches_num);
+            changed = 0;
         }
 
-        fclose(tmp_file);
-        fclose(file);
-        char *argv[] = { "mv", tmp_clipboard_path, clipboard_path, (char *)0 };
-        pid_t pid = fork_exec(argv[0], argv);
-        int status;
-        waitpid(pid, &status, 0);
-        free(tmp_clipboard_path);
+        wtimeout(win, (scored < num) ? 0 : REFRESH_FINDER);
+        key = read_key(win);
+        if (key == ERR)
+            continue;
+        if (key == KEY_RETURN || key == 27) // 27: Escape
+            break;
+        changed = 1;
+        if (key == KEY_UP || key == 16) // Ctrl-P
+            selected = (selected > 0) ? selected - 1 : 0;
+        else if (key == KEY_DOWN || key == 14) // Ctrl-N
+            selected = (selected < top_num - 1) ? selected + 1 : selected;
+        else if (key == 127 || key == 8 || key == KEY_BACKSPACE)
+        {
+            /* A shorter query matches more files, they are scored again */
+            if (len > 0)
+                query[--len] = '\0';
+            matches_num = 0;
+            scored = 0;
+            selected = 0;
+        }
+        else if (key >= ' ' && key < 256 && len < NAME_MAX)
+        {
+            char c = key;
+            fold_case(&query[len++], &c, 1);
+
+            /* Only the matches of the shorter query can match, with new scores */
+            int kept = 0;
+            for (int i = 0; i < matches_num; i++)
+            {
+                int score = fuzzy_score(finder->results[matches[i].index], query, len);
+                if (score != INT_MIN)
+                    matches[kept++] = (fuzzy_match) { matches[i].index, score };
+            }
+            matches_num = kept;
+            if (len == 1)
+                scored = 0;
+            selected = 0;
+        }
     }
-}
+    curs_set(0);
 
-void remove_files(pane *pane)
-{
-    if (clipboard_num != 0)
+    /* The pane goes to the directory of the chosen file */
+    if (key == KEY_RETURN && top_num > 0)
     {
-        FILE *file = fopen(clipboard_path, "r");
-        char buf[PATH_MAX];
-        int del_num = 0;
-        while(fgets(buf, PATH_MAX, file))
+        char *path = finder->results[top[selected].index];
+        char *slash = strrchr(path, '/');
+        const char *root = (pane->path[1] == '\0') ? "" : pane->path;
+        int alloc_size = snprintf(NULL, 0, "%s/%.*s", root, (slash != NULL) ? (int) (slash - path) : 0, path);
+        char *dir = malloc(alloc_size + 1);
+        pane->jump_name = strdup((slash != NULL) ? slash + 1 : path);
+        if (dir == NULL || pane->jump_name == NULL)
         {
-            buf[strcspn(buf, "\r\n")] = 0;
-            if (rm_file(buf) == 0)
-                del_num++;
+            endwin();
+            perror("memory allocation error\n");
+            exit(EXIT_FAILURE);
         }
-        if (del_num != clipboard_num)
-            print_notification("Some files aren't deleted. Permission denied!");
-        fclose(file);
-        remove(clipboard_path);
-        clipboard_num = 0;
+        snprintf(dir, alloc_size + 1, "%s/%.*s", root, (slash != NULL) ? (int) (slash - path) : 0, path);
+        if (slash == NULL)
+            dir[(alloc_size > 1) ? alloc_size - 1 : 1] = '\0'; // The root itself, without the last '/'
+        free(pane->path);
+        pane->path = dir;
+        pane->list_dirty = 1;
         pane->select = 1;
+        pane->top_index = 0;
     }
-    else
+    free(matches);
+    stop_finder(finder);
+    close_window(win);
+}
+
+void print_finder(WINDOW *win, finder *finder, const char *query, fuzzy_match *top, int top_num, int selected, int num)
+{
+    werase(win);
+    box(win, 0, 0);
+    for (int i = 0; i < top_num; i++)
     {
-        if (rm_file(pane->select_path) == 0)
-            pane->select = 1;
-        else
-            print_notification("Permission denied!");
+        if (i == selected)
+            wattron(win, A_STANDOUT);
+        mvwaddnstr(win, i + 2, 2, finder->results[top[i].index], getmaxx(win) - 4);
+        wattroff(win, A_STANDOUT);
     }
+
+    /* The counts on the right of the prompt, the dots while the walk goes on */
+    char counts[64];
+    int walking = __atomic_load_n(&finder->pending, __ATOMIC_ACQUIRE) != 0;
+    int len = snprintf(counts, sizeof(counts), "%d/%d%s", num, __atomic_load_n(&finder->num, __ATOMIC_ACQUIRE),
+                       (walking == 1) ? " ..." : "");
+    mvwaddstr(win, 1, getmaxx(win) - len - 2, counts);
+    wattron(win, COLOR_PAIR(2));
+    mvwprintw(win, 1, 2, "Find: ");
+    wattroff(win, COLOR_PAIR(2));
+    waddnstr(win, query, getmaxx(win) - len - 12);
+    wrefresh(win);
 }
 
-int rm_file(char *path)
+int get_top_matches(fuzzy_match *matches, int num, fuzzy_match *top, int size)
 {
-    if (access(path, W_OK) == 0)
-    {
-        char *argv[] = { "rm", "-f", "-r", path, (char *)0 };
-        pid_t pid = fork_exec(argv[0], argv);
-        int status;
-        waitpid(pid, &status, 0);
+    /* The best matches by insertion, the shorter path wins among equal scores */
+    int top_num = 0;
+    if (size <= 0)
         return 0;
+    for (int i = 0; i < num; i++)
+    {
+        if (top_num == size && matches[i].score <= top[top_num - 1].score)
+            continue;
+        int j = (top_num < size) ? top_num++ : top_num - 1;
+        for (; j > 0 && top[j - 1].score < matches[i].score; j--)
+            top[j] = top[j - 1];
+        top[j] = matches[i];
     }
-    return -1;
+    return top_num;
 }
 
-void yank_files(pane *pane)
+int fuzzy_score(const char *text, const char *query, int len)
 {
-    if (clipboard_num != 0)
+    /* As fzf: the first window that has the query as a subsequence is shortened from its end */
+    int pos = 0;
+    int end = -1;
+    for (int i = 0; text[i] != '\0'; i++)
     {
-        FILE *file = fopen(clipboard_path, "r");
-        char buf[PATH_MAX];
-        int cp_num = 0;
-        while(fgets(buf, PATH_MAX, file))
+        char c = (text[i] >= 'A' && text[i] <= 'Z') ? text[i] + 'a' - 'A' : text[i];
+        if (c == query[pos] && ++pos == len)
         {
-            buf[strcspn(buf, "\r\n")] = 0;
-            if (cp_file(buf, pane->path) == 0)
-                cp_num++;
+            end = i;
+            break;
         }
-        if (cp_num != clipboard_num)
-            print_notification("Some files aren't copied. Permission denied!");
-        fclose(file);
-        remove(clipboard_path);
-        clipboard_num = 0;
-        pane->select = 1;
     }
-    else
+    if (end == -1)
+        return INT_MIN;
+    int start = end;
+    for (pos = len - 1; start >= 0; start--)
     {
-        /* Make a copy of the selected file in the current directory. */
-        if (access(pane->path, W_OK) == 0)
+        char c = (text[start] >= 'A' && text[start] <= 'Z') ? text[start] + 'a' - 'A' : text[start];
+        if (c == query[pos] && --pos < 0)
+            break;
+    }
+
+    /* Matched characters, more after each other and at the start of words, gaps cost */
+    int score = 0;
+    int consecutive = 0;
+    pos = 0;
+    for (int i = start; i <= end; i++)
+    {
+        char c = (text[i] >= 'A' && text[i] <= 'Z') ? text[i] + 'a' - 'A' : text[i];
+        if (c != query[pos])
         {
-            int alloc_size = snprintf(NULL, 0, "%s~", pane->select_path);
-            char *cpy_path = malloc(alloc_size + 1);
-            if (cpy_path == NULL)
-            {
-                endwin();
-                perror("memory allocation error\n");
-                exit(EXIT_FAILURE);
-            }
-            snprintf(cpy_path, alloc_size + 1, "%s~", pane->select_path);
-            char *argv[] = { "cp", "-b", "-r", pane->select_path, cpy_path, (char *)0 };
-            pid_t pid = fork_exec(argv[0], argv);
-            int status;
-            waitpid(pid, &status, 0);
-            free(cpy_path);
+            score -= (consecutive > 0) ? 3 : 1;
+            consecutive = 0;
+            continue;
         }
-        else
-            print_notification("Permission denied!");
+        score += 16 + 4 * consecutive;
+        if (i == 0 || text[i - 1] == '/')
+            score += 10;
+        else if (strchr("_-. ", text[i - 1]) != NULL || (islower((unsigned char) text[i - 1]) && isupper((unsigned char) text[i])))
+            score += 8;
+        consecutive++;
+        pos++;
     }
+
+    /* A match in the name of the file is better than in the directories, so is a shorter path */
+    const char *name = strrchr(text, '/');
+    if (name == NULL || name - text < start)
+        score += 12;
+    return score - (int) strlen(text) / 16;
 }
 
-int cp_file(char *path, char *dir)
+finder *start_finder(const char *root)
 {
-    if (access(dir, W_OK) == 0)
+    finder *finder = calloc(1, sizeof(struct finder));
+    if (finder == NULL || (finder->root = strdup(root)) == NULL)
     {
-        char *argv[] = { "cp", "-b", "-r", path, dir, (char *)0 };
-        pid_t pid = fork_exec(argv[0], argv);
-        int status;
-        waitpid(pid, &status, 0);
-        return 0;
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    finder->hidden = hide_flag;
+    struct stat st;
+    finder->dev = (stat(root, &st) == 0) ? st.st_dev : 0;
+    pthread_mutex_init(&finder->lock, NULL);
+    pthread_cond_init(&finder->cond, NULL);
+
+    /* Reserved, not allocated, the pages are used as the paths are found */
+    finder->results = mmap(NULL, FINDER_MAX * sizeof(char *), PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (finder->results == MAP_FAILED)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
     }
-    return -1;
-}
 
-void move_files(pane *pane)
-{
-    if (clipboard_num != 0)
+    for (int i = 0; i < FINDER_THREADS; i++)
     {
-        FILE *file = fopen(clipboard_path, "r");
-        char buf[PATH_MAX];
-        int mv_num = 0;
-        while(fgets(buf, PATH_MAX, file))
+        walker *walker = &finder->walkers[i];
+        walker->finder = finder;
+        pthread_mutex_init(&walker->lock, NULL);
+        if ((walker->buf = malloc(READDIR_BUF)) == NULL)
         {
-            buf[strcspn(buf, "\r\n")] = 0;
-            if (mv_file(buf, pane->path) == 0)
-                mv_num++;
+            endwin();
+            perror("memory allocation error\n");
+            exit(EXIT_FAILURE);
         }
-        if (mv_num != clipboard_num)
-            print_notification("Some files aren't moved. Permission denied!");
-        fclose(file);
-        remove(clipboard_path);
-        clipboard_num = 0;
-        pane->select = 1;
     }
-    else
-        print_notification("The clipboard is empty. Please select the files.");
+    push_dir(&finder->walkers[0], "");
+
+    sigset_t old_set;
+    pthread_sigmask(SIG_BLOCK, &signal_set, &old_set);
+    for (int i = 0; i < FINDER_THREADS; i++)
+        if (pthread_create(&finder->threads[finder->threads_num], NULL, run_walker, &finder->walkers[i]) == 0)
+            finder->threads_num++;
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    return finder;
 }
 
-int mv_file(char *path, char *dir)
+void stop_finder(finder *finder)
 {
-    if (access(dir, W_OK) == 0 && access(path, W_OK) == 0)
+    pthread_mutex_lock(&finder->lock);
+    finder->cancelled = 1;
+    pthread_cond_broadcast(&finder->cond);
+    pthread_mutex_unlock(&finder->lock);
+    for (int i = 0; i < finder->threads_num; i++)
+        pthread_join(finder->threads[i], NULL);
+
+    for (int i = 0; i < FINDER_THREADS; i++)
     {
-        char *argv[] = { "mv", "-b", path, dir, (char *)0 };
-        pid_t pid = fork_exec(argv[0], argv);
-        int status;
-        waitpid(pid, &status, 0);
-        return 0;
+        free(finder->walkers[i].dirs);
+        free(finder->walkers[i].buf);
+        pthread_mutex_destroy(&finder->walkers[i].lock);
     }
-    return -1;
+    for (int i = 0; i < finder->chunks_num; i++)
+        free(finder->chunks[i]);
+    free(finder->chunks);
+    munmap(finder->results, FINDER_MAX * sizeof(char *));
+    pthread_mutex_destroy(&finder->lock);
+    pthread_cond_destroy(&finder->cond);
+    free(finder->root);
+    free(finder);
 }
 
-void rename_file(pane *pane)
+void *run_walker(void *arg)
 {
-    char *new_name = malloc(NAME_MAX);
-    if (new_name == NULL)
+    walker *walker = arg;
+    finder *finder = walker->finder;
+    for (;;)
     {
-        endwin();
-        perror("memory allocation error\n");
-        exit(EXIT_FAILURE);
-    }
-    echo();
-    curs_set(1);
-    wgetnstr(status_bar, new_name, NAME_MAX);
-    noecho();
-    curs_set(0);
-    if (strlen(new_name) != 0 && is_empty_str(new_name) != 0)
-    { if (access(pane->select_path, W_OK) == 0)
+        char *dir = take_dir(walker);
+        if (dir != NULL)
         {
-            int alloc_size = snprintf(NULL, 0, "%s/%s", pane->path, new_name);
-            char *new_path = malloc(alloc_size + 1);
-            if (new_path == NULL)
-            {
-                endwin();
-                perror("memory allocation error\n");
-                exit(EXIT_FAILURE);
-            }
-            snprintf(new_path, alloc_size + 1, "%s/%s", pane->path, new_name);
-            char *argv[] = { "mv", "-b", pane->select_path, new_path, (char *)0 };
-            pid_t pid = fork_exec(argv[0], argv);
-            int status;
-            waitpid(pid, &status, 0);
-            free(new_path);
-            pane->select = 1;
+            walk_dir(walker, dir);
+            publish_results(walker);
+            pthread_mutex_lock(&finder->lock);
+            if (--finder->pending == 0)
+                pthread_cond_broadcast(&finder->cond); // The walk is over
+            pthread_mutex_unlock(&finder->lock);
+            continue;
         }
-        else
-            print_notification("Permission denied!");
-    }
-    else
-        print_notification("Please enter the correct name!");
-    free(new_name);
-}
 
-int is_empty_str(const char *str)
-{
-    while (*str != '\0')
-    {
-        if (isspace((unsigned char) *str) == 0)
-            return -1;
-        str++;
+        /* Nothing to steal, wait for new directories or the end of the walk */
+        pthread_mutex_lock(&finder->lock);
+        while (finder->queued == 0 && finder->pending != 0 && finder->cancelled == 0)
+            pthread_cond_wait(&finder->cond, &finder->lock);
+        int over = finder->pending == 0 || finder->cancelled == 1;
+        pthread_mutex_unlock(&finder->lock);
+        if (over == 1)
+            return NULL;
     }
-    return 0;
 }
 
-void open_shell(pane *pane)
+char *take_dir(walker *walker)
 {
-    endwin();
-    sigprocmask(SIG_BLOCK, &signal_set, NULL); // block SIGWINCH
-    pid_t pid;
-    pid = fork();
-    if (pid == -1)
+    /* The own queue first, the last pushed directory is the nearest one */
+    finder *finder = walker->finder;
+    char *dir = NULL;
+    int id = walker - finder->walkers;
+    for (int i = 0; i < FINDER_THREADS && dir == NULL; i++)
     {
-        endwin();
-        perror("fork error\n");
-        exit(EXIT_FAILURE);
+        struct walker *victim = &finder->walkers[(id + i) % FINDER_THREADS];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head != victim->tail)
+            dir = (i == 0) ? victim->dirs[--victim->tail] : victim->dirs[victim->head++];
+        pthread_mutex_unlock(&victim->lock);
     }
-    if (pid == 0)
+    if (dir != NULL)
     {
-        chdir(pane->path);
-        char *cmd[] = { shell, (char *)0 };
-        execvp(cmd[0], cmd);
-        perror("EXEC:\n");
-        exit(EXIT_FAILURE);
+        pthread_mutex_lock(&finder->lock);
+        finder->queued--;
+        pthread_mutex_unlock(&finder->lock);
     }
-    int status;
-    waitpid(pid, &status, 0);
-
-    /* refresh */
-    left_pane.select = 1;
-    right_pane.select = 1;
-    left_pane.top_index = 0;
-    right_pane.top_index = 0;
-    refresh();
+    return (__atomic_load_n(&finder->cancelled, __ATOMIC_RELAXED) == 1) ? NULL : dir;
 }
 
-void select_all(pane *pane)
+void walk_dir(walker *walker, char *dir)
 {
-    remove(clipboard_path);
-    clipboard_num = 0;
-    char *dirs_list[pane->dirs_num];
-    char *files_list[pane->files_num];
-    get_files_in_array(pane->path, dirs_list, files_list);
-    add_list_clipboard(dirs_list, pane->path, pane->dirs_num);
-    add_list_clipboard(files_list, pane->path, pane->files_num);
-    free_array(dirs_list, pane->dirs_num);
-    free_array(files_list, pane->files_num);
-}
+    finder *finder = walker->finder;
+    char path[PATH_MAX];
+    struct stat st;
+    if (snprintf(path, sizeof(path), "%s/%s", (finder->root[1] == '\0') ? "" : finder->root, dir) >= PATH_MAX)
+        return;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    if (fstat(fd, &st) == -1 || st.st_dev != finder->dev)
+    {
+        close(fd); // Another file system is not walked
+        return;
+    }
 
-void add_list_clipboard(char *list[], char *path, int num)
-{
-    int alloc_size;
-    char *filepath = NULL;
-    for (int index = 0; index < num; index++)
+    long len;
+    while ((len = getdents64(fd, walker->buf, READDIR_BUF)) > 0)
     {
-        alloc_size = snprintf(NULL, 0, "%s/%s", path, list[index]);
-        filepath = malloc(alloc_size + 1);
-        if (filepath == NULL)
+        for (long pos = 0; pos < len; )
         {
-            endwin();
-            perror("memory allocation error\n");
-            exit(EXIT_FAILURE);
+            struct dirent64 *dirent = (struct dirent64 *) (walker->buf + pos);
+            char *name = dirent->d_name;
+            pos += dirent->d_reclen;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            if (finder->hidden == 0 && name[0] == '.')
+                continue;
+
+            char *found = store_path(walker, dir, name, strlen(name));
+            if (found == NULL)
+                continue;
+            walker->batch[walker->batch_num++] = found;
+            if (walker->batch_num == FINDER_BATCH)
+                publish_results(walker);
+
+            unsigned char type = dirent->d_type;
+            if (type == DT_UNKNOWN && fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+                type = IFTODT(st.st_mode);
+            if (type == DT_DIR)
+                push_dir(walker, found);
         }
-        snprintf(filepath, alloc_size + 1, "%s/%s", path, list[index]);
-        append_clipboard(filepath);
-        free(filepath);
+        if (__atomic_load_n(&finder->cancelled, __ATOMIC_RELAXED) == 1)
+            break;
     }
+    close(fd);
 }
 
-void make_new(pane *pane, char *cmd)
+void push_dir(walker *walker, char *dir)
 {
-    char *new = malloc(NAME_MAX);
-    if (new == NULL)
-    {
-        endwin();
-        perror("memory allocation error\n");
-        exit(EXIT_FAILURE);
-    }
-    echo();
-    curs_set(1);
-    wgetnstr(status_bar, new, NAME_MAX);
-    noecho();
-    curs_set(0);
-    if (strlen(new) != 0 && is_empty_str(new) != 0)
+    pthread_mutex_lock(&walker->lock);
+    if (walker->tail == walker->cap)
     {
-        if (access(pane->path, W_OK) == 0)
+        /* The stolen part at the head is reused */
+        memmove(walker->dirs, walker->dirs + walker->head, (walker->tail - walker->head) * sizeof(char *));
+        walker->tail -= walker->head;
+        walker->head = 0;
+        if (walker->tail * 2 >= walker->cap)
         {
-            int alloc_size = snprintf(NULL, 0, "%s/%s", pane->path, new);
-            char *new_path = malloc(alloc_size + 1);
-            if (new_path == NULL)
+            walker->cap = walker->cap * 2 + 64;
+            walker->dirs = realloc(walker->dirs, walker->cap * sizeof(char *));
+            if (walker->dirs == NULL)
             {
                 endwin();
                 perror("memory allocation error\n");
                 exit(EXIT_FAILURE);
             }
-            snprintf(new_path, alloc_size + 1, "%s/%s", pane->path, new);
-            if (access(new_path, R_OK) != 0)
-            {
-                char *argv[] = { cmd, new_path, (char *)0 };
-                pid_t pid = fork_exec(argv[0], argv);
-                int status;
-                waitpid(pid, &status, 0);
-                free(new_path);
-                pane->select = 1;
-            }
-            else
-                print_notification("File/directory exists!");
         }
-        else
-            print_notification("Permission denied!");
     }
-    else
-        print_notification("Please enter the correct name!");
-    free(new);
+    walker->dirs[walker->tail++] = dir;
+    pthread_mutex_unlock(&walker->lock);
+
+    pthread_mutex_lock(&walker->finder->lock);
+    walker->finder->queued++;
+    walker->finder->pending++;
+    pthread_cond_signal(&walker->finder->cond);
+    pthread_mutex_unlock(&walker->finder->lock);
 }
 
-void preview_select(pane *pane)
+char *store_path(walker *walker, const char *dir, const char *name, size_t len)
 {
-    if (access(pane->select_path, R_OK) == 0)
+    /* The path relative to the root, in the chunk of the walker */
+    size_t dir_len = strlen(dir);
+    size_t size = dir_len + (dir_len != 0) + len + 1;
+    if (size > PATH_MAX)
+        return NULL;
+    if (walker->chunk == NULL || walker->chunk_used + size > FINDER_CHUNK)
     {
-        endwin();
-        sigprocmask(SIG_BLOCK, &signal_set, NULL); // block SIGWINCH
-        if (is_dir(pane->select_path) == 0)
+        finder *finder = walker->finder;
+        walker->chunk = malloc(FINDER_CHUNK);
+        walker->chunk_used = 0;
+        pthread_mutex_lock(&finder->lock);
+        if (walker->chunk != NULL && finder->chunks_num == finder->chunks_cap)
         {
-            char *argv[] = { "less", pane->select_path, (char *)0 };
-            pid_t pid = fork_exec(argv[0], argv);
-            int status;
-            waitpid(pid, &status, 0);
+            finder->chunks_cap = finder->chunks_cap * 2 + 64;
+            finder->chunks = realloc(finder->chunks, finder->chunks_cap * sizeof(char *));
         }
-        else
+        if (walker->chunk == NULL || finder->chunks == NULL)
         {
-            /* ls -lAh | less */
-            int pipefd[2];
-            if (pipe(pipefd) == -1)
-            {
-                endwin();
-                perror("pipe error\n");
-                exit(EXIT_FAILURE);
-            }
-
-            pid_t pid1 = fork();
-            if (pid1 == -1)
-            {
-                endwin();
-                perror("fork error\n");
-                exit(EXIT_FAILURE);
-            }
-            if (pid1 == 0)
-            {
-                int fd = open("/dev/null", O_WRONLY);
-                dup2(fd, STDERR_FILENO);
-                close(fd);
-                dup2(pipefd[1], STDOUT_FILENO);
-                close(pipefd[0]);
-                close(pipefd[1]);
-                char *argv[] = { "ls", "-l", "-A", "-h", pane->select_path, (char *)0 };
-                execvp(argv[0], argv);
-                perror("EXEC:\n");
-                exit(EXIT_FAILURE);
-            }
-
-            pid_t pid2 = fork();
-            if (pid2 == -1)
-            {
-                endwin();
-                perror("fork error\n");
-                exit(EXIT_FAILURE);
-            }
-            if (pid2 == 0)
-            {
-                int fd = open("/dev/null", O_WRONLY);
-                dup2(fd, STDERR_FILENO);
-                close(fd);
-                dup2(pipefd[0], STDIN_FILENO);
-                close(pipefd[0]);
-                close(pipefd[1]);
-                char *argv[] = { "less", (char *)0 };
-                execvp(argv[0], argv);
-                perror("EXEC:\n");
-                exit(EXIT_FAILURE);
-            }
-
-            close(pipefd[0]);
-            close(pipefd[1]);
-            int status;
-            waitpid(pid1, &status, 0);
-            waitpid(pid2, &status, 0);
+            endwin();
+            perror("memory allocation error\n");
+            exit(EXIT_FAILURE);
         }
+        finder->chunks[finder->chunks_num++] = walker->chunk;
+        pthread_mutex_unlock(&finder->lock);
     }
-    else
-        print_notification("Permission denied!");
+    char *path = walker->chunk + walker->chunk_used;
+    memcpy(path, dir, dir_len);
+    if (dir_len != 0)
+        path[dir_len] = '/';
+    memcpy(path + dir_len + (dir_len != 0), name, len + 1);
+    walker->chunk_used += size;
+    return path;
 }
 
-int get_bookmarks_num()
+void publish_results(walker *walker)
 {
-    int num = 0;
-    FILE *file = fopen(bookmarks_path, "r");
-    if (file != NULL)
+    /* The UI thread reads the results up to num without the lock */
+    finder *finder = walker->finder;
+    if (walker->batch_num == 0)
+        return;
+    pthread_mutex_lock(&finder->lock);
+    int num = finder->num;
+    if (num + walker->batch_num > FINDER_MAX)
+        walker->batch_num = FINDER_MAX - num; // The rest is not shown
+    memcpy(finder->results + num, walker->batch, walker->batch_num * sizeof(char *));
+    __atomic_store_n(&finder->num, num + walker->batch_num, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&finder->lock);
+    walker->batch_num = 0;
+}
+
+void update_usage(pane *pane)
+{
+    /* The directories get the totals found so far, the scan is asked for if they are not known */
+    listing *list = &pane->list;
+    struct stat st;
+    int scan = 0;
+    int changed = 0;
+    if (stat(pane->path, &st) == -1)
+        return;
+    pthread_mutex_lock(&usage_lock);
+    usage_node *node = find_usage(st.st_dev, st.st_ino);
+    if (node == NULL || node->state == USAGE_STALE || (node->state == USAGE_DONE &&
+        (node->mtime.tv_sec != st.st_mtim.tv_sec || node->mtime.tv_nsec != st.st_mtim.tv_nsec)))
+        scan = 1;
+    for (int i = 0; i < list->num; i++)
     {
-        char buf[PATH_MAX];
-        while(fgets(buf, PATH_MAX, file))
-            num++;
-        fclose(file);
-        return num;
+        entry *e = &list->entries[i];
+        if (e->type != DT_DIR)
+            continue;
+        usage_node *child = find_usage(st.st_dev, e->ino);
+        int64_t size = (child != NULL) ? __atomic_load_n(&child->size, __ATOMIC_RELAXED) : 0;
+        if (child == NULL || child->state == USAGE_STALE)
+            scan |= node == NULL || node->state != USAGE_SCANNING;
+        changed |= e->value != size;
+        e->value = size;
+    }
+    pane->usage_total = (node != NULL) ? __atomic_load_n(&node->size, __ATOMIC_RELAXED) : 0;
+    pane->usage_scanning = scan == 1 || node->state == USAGE_SCANNING;
+    pthread_mutex_unlock(&usage_lock);
+    if (scan == 1)
+        request_usage(pane->path);
+    pane->usage_generation = usage_generation;
+
+    /* The cursor stays on the same file when the files are sorted again */
+    char *selected = NULL;
+    int num = pane->dirs_num + pane->files_num;
+    if (pane->list.view_hide_flag == hide_flag && num != 0 &&
+        (selected = strdup(get_name(pane, pane->top_index + pane->select - 1))) == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
     }
-    return -1;
+    if (changed == 1)
+        sort_listing(list);
+    filter_listing(pane);
+    pane->usage_max = 0;
+    for (int i = 0; i < list->view_num; i++)
+        if (list->entries[list->view[i]].value > pane->usage_max)
+            pane->usage_max = list->entries[list->view[i]].value;
+    pane->redraw = 1;
+    if (selected != NULL && changed == 1)
+        go_to_name(pane, selected);
+    free(selected);
 }
 
-int exist_bookmark(char key)
+void print_usage(pane *pane, int line_pos, int index)
 {
-    FILE *file = fopen(bookmarks_path, "r");
-    if (file != NULL)
+    /* The size of the subtree and a bar relative to the largest file of the directory */
+    int64_t value = pane->list.entries[pane->list.view[index]].value;
+    int width = getmaxx(pane->win) - 1; // The last column is under the other pane
+    if (width - 2 - DETAILS_NAME < USAGE_BAR + 14)
+        return;
+    char size[16];
+    char bar[USAGE_BAR + 1];
+    int filled = (pane->usage_max > 0) ? value * USAGE_BAR / pane->usage_max : 0;
+    if (filled > USAGE_BAR)
+        filled = USAGE_BAR; // A file added after the totals were taken
+    memset(bar, '#', filled);
+    memset(bar + filled, ' ', USAGE_BAR - filled);
+    bar[USAGE_BAR] = '\0';
+    wmove(pane->win, line_pos, width - USAGE_BAR - 14);
+    wclrtoeol(pane->win);
+    wprintw(pane->win, "  %9s [%s]", get_human_filesize(value, size), bar);
+}
+
+void request_usage(const char *path)
+{
+    pthread_mutex_lock(&usage_lock);
+    for (int i = 0; i < usage_roots_num; i++)
     {
-        char buf[PATH_MAX];
-        while(fgets(buf, PATH_MAX, file))
+        if (strcmp(usage_roots[i], path) == 0)
         {
-            if (buf[0] == key)
+            pthread_mutex_unlock(&usage_lock);
+            return; // Already waiting
+        }
+    }
+    if (usage_roots_num == USAGE_ROOTS)
+    {
+        free(usage_roots[0]);
+        memmove(usage_roots, usage_roots + 1, (USAGE_ROOTS - 1) * sizeof(char *));
+        usage_roots_num--;
+    }
+    if ((usage_roots[usage_roots_num++] = strdup(path)) == NULL)
+    {
+        endwin();
+        perror("memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_cond_broadcast(&usage_cond);
+
+    /* The workers are started when the first scan is needed */
+    if (usage_threads == 0)
+    {
+        sigset_t old_set;
+        pthread_sigmask(SIG_BLOCK, &signal_set, &old_set);
+        for (int i = 0; i < USAGE_THREADS; i++)
+        {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, run_usage_worker, NULL) == 0)
             {
-                fclose(file);
-                return 0;
+                pthread_detach(thread);
+                usage_threads++;
             }
         }
-        fclose(file);
+        pthread_sigmask(SIG_SETMASK, &old_set, NULL);
     }
-    return -1;
+    pthread_mutex_unlock(&usage_lock);
 }
 
-void add_bookmark(char *path, char key)
+void stop_usage()
 {
-    FILE *file = fopen(bookmarks_path, "a+");
-    if (file == NULL)
-    {
-        endwin();
-        perror("bookmarks access error\n");
-        exit(EXIT_FAILURE);
-    }
-    fprintf(file, "%c:%s\n", key, path);
-    fclose(file);
+    /* The unfinished directories are scanned again when they are shown */
+    pthread_mutex_lock(&usage_lock);
+    for (int i = 0; i < usage_roots_num; i++)
+        free(usage_roots[i]);
+    usage_roots_num = 0;
+    if (usage_root != NULL)
+        __atomic_store_n(&usage_cancel, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&usage_lock);
 }
 
-void print_bookmarks()
+void *run_usage_worker(void *arg)
 {
-    int i = 0;
-    char buf[PATH_MAX];
-    FILE *file = fopen(bookmarks_path, "r");
-    if (file == NULL)
+    (void) arg;
+    pthread_mutex_lock(&usage_lock);
+    for (;;)
     {
-        endwin();
-        perror("bookmarks access error\n");
-        exit(EXIT_FAILURE);
+        /* The scans run one after another, a directory is never counted by two of them */
+        if (usage_tasks_num == 0 && usage_root == NULL && usage_roots_num > 0)
+        {
+            start_usage();
+            continue;
+        }
+        if (usage_tasks_num == 0)
+        {
+            pthread_cond_wait(&usage_cond, &usage_lock);
+            continue;
+        }
+        usage_task task = usage_tasks[--usage_tasks_num];
+        pthread_mutex_unlock(&usage_lock);
+
+        if (__atomic_load_n(&usage_cancel, __ATOMIC_RELAXED) == 0)
+            scan_usage(&task);
+        free(task.path);
+        notify_usage(0);
+
+        pthread_mutex_lock(&usage_lock);
+        finish_usage(task.node);
     }
-    bookmarks = create_window(bookmarks_num + 3, termsize_x, termsize_y - bookmarks_num - 4, 0);
-    wattron(bookmarks, COLOR_PAIR(2));
-    wmove(bookmarks, 1, 1);
-    wprintw(bookmarks, "mark\tpath\n");
-    wattroff(bookmarks, COLOR_PAIR(2));
-    while(fgets(buf, PATH_MAX, file))
+    return NULL;
+}
+
+void start_usage()
+{
+    /* The oldest waiting directory becomes the top of the scan */
+    char *path = usage_roots[0];
+    struct stat st;
+    memmove(usage_roots, usage_roots + 1, (USAGE_ROOTS - 1) * sizeof(char *));
+    usage_roots_num--;
+    if (stat(path, &st) == -1 || S_ISDIR(st.st_mode) == 0)
     {
-        wmove(bookmarks, i + 2, 1);
-        wprintw(bookmarks, " %c", buf[0]);
-        wprintw(bookmarks, "\t%s", &buf[2]);
-        i++;
+        free(path);
+        return;
     }
-    fclose(file);
-    box(bookmarks, 0, 0);
-    wrefresh(bookmarks);
+    usage_node *node = find_usage(st.st_dev, st.st_ino);
+    if (node == NULL)
+        node = add_usage(st.st_dev, st.st_ino);
+    node->state = USAGE_SCANNING;
+    node->size = 0;
+    node->links = 0;
+    node->mtime = st.st_mtim;
+    usage_root = node;
+    usage_dev = st.st_dev;
+    usage_links_used = 0;
+    if (usage_links != NULL)
+        memset(usage_links, 0, usage_links_cap * sizeof(usage_link));
+    push_usage(node, path);
 }
 
-void open_bookmark(char key, pane *pane)
+void scan_usage(usage_task *task)
 {
-    FILE *file = fopen(bookmarks_path, "r");
-    if (file == NULL)
+    static __thread char *buf = NULL; // The workers are never stopped, the buffer is kept
+    usage_node *node = task->node;
+    struct stat st;
+    long len;
+    if (buf == NULL && (buf = malloc(COPY_DIRBUF)) == NULL)
     {
         endwin();
-        perror("bookmarks access error\n");
+        perror("memory allocation error\n");
         exit(EXIT_FAILURE);
     }
-    char buf[PATH_MAX];
-    while(fgets(buf, PATH_MAX, file))
+    int fd = open(task->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC | ((node == usage_root) ? 0 : O_NOFOLLOW));
+    if (fd == -1)
+        return;
+    int64_t own = (fstat(fd, &st) == 0) ? st.st_blocks * 512 : 0; // The directory itself takes space too
+
+    while ((len = getdents64(fd, buf, COPY_DIRBUF)) > 0)
     {
-        if (buf[0] == key)
+        for (long pos = 0; pos < len; )
         {
-            buf[strcspn(buf, "\r\n")] = 0;
-            int alloc_size = snprintf(NULL, 0, "%s", buf);
-            char *new_path = malloc(alloc_size + 1);
-            if (new_path == NULL)
+            struct dirent64 *pDirent = (struct dirent64 *) (buf + pos);
+            char *name = pDirent->d_name;
+            pos += pDirent->d_reclen;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
             {
-                endwin();
-                perror("memory allocation error\n");
-                exit(EXIT_FAILURE);
+                if (pDirent->d_type != DT_DIR)
+                    continue;
+                st.st_dev = 0; // Counted as empty, so that it is not asked for again
+                st.st_mode = S_IFDIR;
             }
-            strncpy(new_path, buf + 2, strlen(buf) - 1);
-
-            if (access(new_path, R_OK) == 0)
+            if (S_ISDIR(st.st_mode) == 0)
             {
-                free(pane->path);
-                alloc_size = snprintf(NULL, 0, "%s", new_path);
-                pane->path = malloc(alloc_size + 1);
-                if (pane->path == NULL)
+                /* The other links of the file are not counted again, and as they may be
+                 * outside the subtree, the next scan reads the subtree again */
+                if (st.st_nlink > 1)
                 {
-                    endwin();
-                    perror("memory allocation error\n");
-                    exit(EXIT_FAILURE);
+                    pthread_mutex_lock(&usage_lock);
+                    for (usage_node *n = node; n != NULL && n->links == 0; n = (n == usage_root) ? NULL : n->parent)
+                        n->links = 1;
+                    int first = add_link(st.st_dev, st.st_ino);
+                    pthread_mutex_unlock(&usage_lock);
+                    if (first == 0)
+                        continue;
                 }
-                snprintf(pane->path, alloc_size + 1, "%s", new_path);
+                own += st.st_blocks * 512;
+                continue;
+            }
 
-                pane->select = 1;
-                pane->top_index = 0;
-                /* If the directory is empty */
-                alloc_size = snprintf(NULL, 0, "%s", pane->path);
-                free(pane->select_path);
-                pane->select_path = malloc(alloc_size + 1);
-                if (pane->select_path == NULL)
+            /* The inode from the directory, as in the listing, finds the subdirectory */
+            pthread_mutex_lock(&usage_lock);
+            usage_node *child = find_usage(usage_dev, pDirent->d_ino);
+            if (child == NULL)
+                child = add_usage(usage_dev, pDirent->d_ino);
+            if (child->state == USAGE_SCANNING)
+                ; // A loop made by a bind mount
+            else if (st.st_dev != usage_dev)
+            {
+                child->state = USAGE_DONE; // Another file system, or a directory that cannot be read
+                child->size = 0;
+            }
+            else if (child->state == USAGE_DONE && child->links == 0 &&
+                     child->mtime.tv_sec == st.st_mtim.tv_sec && child->mtime.tv_nsec == st.st_mtim.tv_nsec)
+            {
+                child->parent = node; // The cached total of the subtree
+                own += child->size;
+            }
+            else
+            {
+                int alloc_size = snprintf(NULL, 0, "%s/%s", task->path, name);
+                char *path = malloc(alloc_size + 1);
+                if (path == NULL)
                 {
+                    endwin();
                     perror("memory allocation error\n");
                     exit(EXIT_FAILURE);
                 }
-                snprintf(pane->select_path, alloc_size + 1, "%s", pane->path);
+                snprintf(path, alloc_size + 1, "%s/%s", task->path, name);
+                child->state = USAGE_SCANNING;
+                child->size = 0;
+                child->links = 0;
+                child->mtime = st.st_mtim;
+                child->parent = node;
+                node->pending++;
+                push_usage(child, path);
             }
-            else
-                print_notification("The directory doesn't exist.");
-            free(new_path);
-            break;
+            pthread_mutex_unlock(&usage_lock);
         }
+        if (__atomic_load_n(&usage_cancel, __ATOMIC_RELAXED) == 1)
+            break;
     }
-    fclose(file);
+    close(fd);
+
+    /* The directories above grow while the scan goes on */
+    for (usage_node *n = node; n != NULL; n = (n == usage_root) ? NULL : n->parent)
+        __atomic_add_fetch(&n->size, own, __ATOMIC_RELAXED);
 }
 
-void remove_bookmark(char key)
+void push_usage(usage_node *node, char *path)
 {
-    FILE *file = fopen(bookmarks_path, "r");
-    if (file != NULL)
+    if (usage_tasks_num == usage_tasks_cap)
     {
-        char *tmp_bookmarks_path = NULL;
-        int alloc_size = snprintf(NULL, 0, "%s/.bookmarks", conf_path);
-        tmp_bookmarks_path = malloc(alloc_size + 1);
-        if (tmp_bookmarks_path == NULL)
+        usage_tasks_cap = usage_tasks_cap * 2 + 256;
+        usage_tasks = realloc(usage_tasks, usage_tasks_cap * sizeof(usage_task));
+        if (usage_tasks == NULL)
         {
             endwin();
-            perror("temp bookmarks initialization error\n");
+            perror("memory allocation error\n");
             exit(EXIT_FAILURE);
         }
-        snprintf(tmp_bookmarks_path, alloc_size + 1, "%s/.bookmarks", conf_path);
+    }
+    usage_tasks[usage_tasks_num++] = (usage_task) { node, path };
+    node->pending = 1;
+    pthread_cond_signal(&usage_cond);
+}
 
-        char buf[PATH_MAX];
-        FILE *tmp_file = fopen(tmp_bookmarks_path, "a+");
-        if (tmp_file == NULL)
+void finish_usage(usage_node *node)
+{
+    /* A directory is done with its last subdirectory, the top with the whole scan */
+    int state = (usage_cancel == 1) ? USAGE_STALE : USAGE_DONE;
+    while (node != NULL && --node->pending == 0)
+    {
+        node->state = state;
+        if (node != usage_root)
         {
-            endwin();
-            perror("temp bookmarks access error\n");
-            exit(EXIT_FAILURE);
+            node->reported = node->size;
+            node = node->parent;
+            continue;
         }
-        while (fgets(buf, PATH_MAX, file))
+
+        /* The directories above get the difference, a bind mount may make a loop */
+        int64_t delta = node->size - node->reported;
+        usage_node *above = node->parent;
+        for (int depth = 0; state == USAGE_DONE && above != NULL && depth < PATH_MAX / 2; depth++)
         {
-            buf[strcspn(buf, "\r\n")] = 0;
-            if (buf[0] != key)
-                fprintf(tmp_file, "%s\n", buf);
-            else
-                print_notification("Bookmark deleted.");
+            above->size += delta;
+            above->reported += delta;
+            above = above->parent;
         }
-
-        fclose(tmp_file);
-        fclose(file);
-        char *argv[] = { "mv", tmp_bookmarks_path, bookmarks_path, (char *)0 };
-        pid_t pid = fork_exec(argv[0], argv);
-        int status;
-        waitpid(pid, &status, 0);
-        free(tmp_bookmarks_path);
+        if (state == USAGE_DONE)
+            node->reported = node->size;
+        usage_root = NULL;
+        __atomic_store_n(&usage_cancel, 0, __ATOMIC_RELAXED);
+        pthread_cond_broadcast(&usage_cond); // The next scan can start
+        notify_usage(1);
+        break;
     }
 }
 
-int search_dir(pane *pane, char *substr, int start)
+void notify_usage(int force)
+{
+    /* The UI sorts the files again, so it is woken up only from time to time */
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    if (force == 0 && ms - __atomic_load_n(&usage_notified, __ATOMIC_RELAXED) < USAGE_REFRESH * 100)
+        return;
+    __atomic_store_n(&usage_notified, ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&usage_ready, 1, __ATOMIC_RELEASE);
+    if (write(meta_pipe[1], "", 1) == -1 && errno != EAGAIN)
+        return; // The UI is woken up by the bytes already in the pipe
+}
+
+usage_node *find_usage(dev_t dev, ino_t ino)
+{
+    if (usage_table_cap == 0)
+        return NULL;
+    usage_node *node = usage_table[(ino ^ dev * 0x9E3779B97F4A7C15ULL) & (usage_table_cap - 1)];
+    while (node != NULL && (node->ino != ino || node->dev != dev))
+        node = node->hash_next;
+    return node;
+}
+
+usage_node *add_usage(dev_t dev, ino_t ino)
 {
-    char *dirs_list[pane->dirs_num];
-    char *files_list[pane->files_num];
-    get_files_in_array(pane->path, dirs_list, files_list);
-    qsort(dirs_list, pane->dirs_num, sizeof(char *), compare_elements);
-    int dir_found = search_list(substr, dirs_list, pane->dirs_num, start);
-    if (dir_found != -1)
+    /* The table is doubled when it has as many nodes as buckets */
+    if (usage_nodes_num == usage_table_cap)
     {
-        if (termsize_y > pane->dirs_num)
+        int cap = (usage_table_cap == 0) ? USAGE_CHUNK : usage_table_cap * 2;
+        usage_node **table = calloc(cap, sizeof(usage_node *));
+        if (table == NULL)
         {
-            pane->top_index = 0;
-            pane->select = dir_found + 1;
+            endwin();
+            perror("memory allocation error\n");
+            exit(EXIT_FAILURE);
         }
-        else if (dir_found < pane->dirs_num - (termsize_y - 2))
+        for (int i = 0; i < usage_table_cap; i++)
         {
-            pane->top_index = dir_found;
-            pane->select = 1;
+            for (usage_node *node = usage_table[i], *next; node != NULL; node = next)
+            {
+                next = node->hash_next;
+                usage_node **bucket = &table[(node->ino ^ node->dev * 0x9E3779B97F4A7C15ULL) & (cap - 1)];
+                node->hash_next = *bucket;
+                *bucket = node;
+            }
         }
-        else
+        free(usage_table);
+        usage_table = table;
+        usage_table_cap = cap;
+    }
+    if (usage_chunk == NULL || usage_chunk_used == USAGE_CHUNK)
+    {
+        usage_chunk = malloc(USAGE_CHUNK * sizeof(usage_node));
+        usage_chunk_used = 0;
+        if (usage_chunk == NULL)
         {
-            pane->top_index = pane->dirs_num - (termsize_y - 2);
-            pane->select = termsize_y - 1 - (pane->dirs_num - dir_found);
+            endwin();
+            perror("memory allocation error\n");
+            exit(EXIT_FAILURE);
         }
     }
-    free_array(dirs_list, pane->dirs_num);
-    free_array(files_list, pane->files_num);
-    return dir_found;
+
+    usage_node *node = &usage_chunk[usage_chunk_used++];
+    memset(node, 0, sizeof(usage_node));
+    node->dev = dev;
+    node->ino = ino;
+    usage_node **bucket = &usage_table[(ino ^ dev * 0x9E3779B97F4A7C15ULL) & (usage_table_cap - 1)];
+    node->hash_next = *bucket;
+    *bucket = node;
+    usage_nodes_num++;
+    return node;
 }
 
-int search_file(pane *pane, char *substr, int start)
+int add_link(dev_t dev, ino_t ino)
 {
-    char *dirs_list[pane->dirs_num];
-    char *files_list[pane->files_num];
-    get_files_in_array(pane->path, dirs_list, files_list);
-    qsort(files_list, pane->files_num, sizeof(char *), compare_elements);
-    int file_found = search_list(substr, files_list, pane->files_num, start);
-    if (file_found != -1)
+    /* Returns 1 the first time the file is seen in the scan */
+    if (usage_links_used * 2 >= usage_links_cap)
     {
-        if (termsize_y > pane->dirs_num + pane->files_num)
-        {
-            pane->top_index = 0;
-            pane->select = pane->dirs_num + file_found + 1;
-        }
-        else if (file_found < pane->files_num - (termsize_y - 2))
+        int cap = (usage_links_cap == 0) ? 1024 : usage_links_cap * 2;
+        usage_link *links = calloc(cap, sizeof(usage_link));
+        if (links == NULL)
         {
-            pane->top_index = pane->dirs_num + file_found;
-            pane->select = 1;
+            endwin();
+            perror("memory allocation error\n");
+            exit(EXIT_FAILURE);
         }
-        else
+        for (int i = 0; i < usage_links_cap; i++)
         {
-            pane->top_index = pane->dirs_num + pane->files_num - (termsize_y - 2);
-            pane->select = termsize_y - 1 - (pane->files_num - file_found);
+            if (usage_links[i].ino == 0)
+                continue;
+            int j = (usage_links[i].ino ^ usage_links[i].dev * 0x9E3779B97F4A7C15ULL) & (cap - 1);
+            while (links[j].ino != 0)
+                j = (j + 1) & (cap - 1);
+            links[j] = usage_links[i];
         }
+        free(usage_links);
+        usage_links = links;
+        usage_links_cap = cap;
+    }
+    int i = (ino ^ dev * 0x9E3779B97F4A7C15ULL) & (usage_links_cap - 1);
+    for (; usage_links[i].ino != 0; i = (i + 1) & (usage_links_cap - 1))
+        if (usage_links[i].ino == ino && usage_links[i].dev == dev)
+            return 0;
+    usage_links[i] = (usage_link) { dev, ino };
+    usage_links_used++;
+    return 1;
+}
+
+int64_t get_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+int64_t start_timer()
+{
+    /* Nothing is measured while the overlay is hidden, a timer started then is 0 */
+    return (__atomic_load_n(&stats_mode, __ATOMIC_RELAXED) == 1) ? get_ns() : 0;
+}
+
+void count_stats(int64_t *counter, int64_t num)
+{
+    if (__atomic_load_n(&stats_mode, __ATOMIC_RELAXED) == 1)
+        __atomic_add_fetch(counter, num, __ATOMIC_RELAXED); // The loaders and the jobs count too
+}
+
+void count_time(int timer, int64_t start)
+{
+    if (start != 0)
+        __atomic_add_fetch(&frame_stats.time[timer], get_ns() - start, __ATOMIC_RELAXED);
+}
+
+void end_frame(int64_t start, int64_t render)
+{
+    if (start == 0 || render == 0)
+    {
+        key_time = 0; // The overlay was opened during the frame
+        return;
     }
-    free_array(dirs_list, pane->dirs_num);
-    free_array(files_list, pane->files_num);
-    return file_found;
+    int64_t now = get_ns();
+    count_time(STATS_RENDER, render);
+    record_latency(&frame_latency, now - start);
+    if (key_time != 0)
+    {
+        record_latency(&key_latency, now - key_time);
+        key_time = 0;
+    }
+
+    /* The counters start again, the overlay shows the frame just drawn */
+    last_stats.entries = __atomic_exchange_n(&frame_stats.entries, 0, __ATOMIC_RELAXED);
+    last_stats.syscalls = __atomic_exchange_n(&frame_stats.syscalls, 0, __ATOMIC_RELAXED);
+    last_stats.allocs = __atomic_exchange_n(&frame_stats.allocs, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < STATS_TIMERS; i++)
+        last_stats.time[i] = __atomic_exchange_n(&frame_stats.time[i], 0, __ATOMIC_RELAXED);
+}
+
+void record_latency(histogram *hist, int64_t ns)
+{
+    int64_t us = ns / 1000;
+    hist->counts[get_hist_bucket(us)]++;
+    hist->total++;
+    if (us > hist->max)
+        hist->max = us;
+}
+
+int get_hist_bucket(int64_t us)
+{
+    /* The small values have a bucket each, then every power of two is split in the same number of buckets */
+    if (us < (1 << HIST_BITS))
+        return us;
+    int shift = 63 - __builtin_clzll(us) - HIST_BITS;
+    int64_t bucket = ((int64_t) (shift + 1) << HIST_BITS) + (us >> shift) - (1 << HIST_BITS);
+    return (bucket < HIST_BUCKETS) ? bucket : HIST_BUCKETS - 1;
+}
+
+int64_t get_hist_value(int bucket)
+{
+    /* The highest value counted in the bucket */
+    if (bucket < (2 << HIST_BITS))
+        return bucket;
+    int shift = (bucket >> HIST_BITS) - 1;
+    int64_t sub = (bucket & ((1 << HIST_BITS) - 1)) + (1 << HIST_BITS);
+    return ((sub + 1) << shift) - 1;
 }
 
-int search_list(char *substr, char *list[], int num, int start)
+int64_t get_percentile(histogram *hist, int permille)
 {
-    for (int index = start; index < num; index++)
+    int64_t rank = (hist->total * permille + 999) / 1000;
+    int64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS && hist->total > 0; i++)
     {
-        char *found = strcasestr(list[index], substr);
-        if (found != NULL)
-            return index;
+        seen += hist->counts[i];
+        if (seen >= rank && seen > 0)
+            return (get_hist_value(i) < hist->max) ? get_hist_value(i) : hist->max;
     }
-    return -1;
+    return hist->max;
 }
 
-void free_array(char *array[], int num)
+void print_stats()
 {
-    for (int i = 0; i < num; i++)
-        free(array[i]);
+    /* Drawn over the right pane on every frame, the counters are of the last frame */
+    int height = 16;
+    int width = 40;
+    if (termsize_y < height + 2 || termsize_x < width + 2)
+        return; // No room for it
+    if (stats_win == NULL)
+        stats_win = create_window(height, width, 1, termsize_x - width - 1);
+    werase(stats_win);
+    wattron(stats_win, COLOR_PAIR(2));
+    mvwprintw(stats_win, 1, 2, "Last frame");
+    wattroff(stats_win, COLOR_PAIR(2));
+    mvwprintw(stats_win, 2, 2, "%-18s%lld", "entries read", (long long) last_stats.entries);
+    mvwprintw(stats_win, 3, 2, "%-18s%lld", "syscalls", (long long) last_stats.syscalls);
+    mvwprintw(stats_win, 4, 2, "%-18s%.3f ms", "listing", last_stats.time[STATS_LIST] / 1e6);
+    mvwprintw(stats_win, 5, 2, "%-18s%.3f ms", "sorting", last_stats.time[STATS_SORT] / 1e6);
+    mvwprintw(stats_win, 6, 2, "%-18s%.3f ms", "rendering", last_stats.time[STATS_RENDER] / 1e6);
+    mvwprintw(stats_win, 7, 2, "%-18s%.3f ms", "file operations", last_stats.time[STATS_FILES] / 1e6);
+    mvwprintw(stats_win, 8, 2, "%-18s~%lld", "listing allocs", (long long) last_stats.allocs);
+    print_latency(stats_win, 9, "Keypress to frame", "keys", &key_latency);
+    print_latency(stats_win, 12, "Frame", "frames", &frame_latency);
+    box(stats_win, 0, 0);
+}
+
+void print_latency(WINDOW *win, int y, const char *title, const char *unit, histogram *hist)
+{
+    wattron(win, COLOR_PAIR(2));
+    mvwprintw(win, y, 2, "%s, %lld %s", title, (long long) hist->total, unit);
+    wattroff(win, COLOR_PAIR(2));
+    mvwprintw(win, y + 1, 2, "p50 %8.2f ms  p90 %8.2f ms", get_percentile(hist, 500) / 1e3,
+              get_percentile(hist, 900) / 1e3);
+    mvwprintw(win, y + 2, 2, "p99 %8.2f ms  max %8.2f ms", get_percentile(hist, 990) / 1e3, hist->max / 1e3);
+}
+
+void save_stats()
+{
+    /* The distributions of the session, in the percentile format of HdrHistogram */
+    FILE *file = fopen(stats_path, "w");
+    if (file == NULL)
+        return;
+    write_histogram(file, "Keypress to frame", &key_latency);
+    write_histogram(file, "Frame", &frame_latency);
+    fclose(file);
+}
+
+void write_histogram(FILE *file, const char *title, histogram *hist)
+{
+    fprintf(file, "# %s, %lld samples, max %.3f ms\n", title, (long long) hist->total, hist->max / 1e3);
+    fprintf(file, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+    long long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        if (hist->counts[i] == 0)
+            continue;
+        seen += hist->counts[i];
+        double percentile = (double) seen / hist->total;
+        double value = ((get_hist_value(i) < hist->max) ? get_hist_value(i) : hist->max) / 1e3;
+        if (seen < hist->total)
+            fprintf(file, "%12.3f %14.12f %10lld %14.2f\n", value, percentile, seen, 1 / (1 - percentile));
+        else
+            fprintf(file, "%12.3f %14.12f %10lld\n", value, percentile, seen);
+    }
+    fprintf(file, "\n");
 }
 
 void take_action(int key, pane *pane)
@@ -1614,6 +7102,8 @@ void take_action(int key, pane *pane)
     {
         case KEY_CHPANE:
             pane_flag = (pane_flag == LEFT) ? RIGHT : LEFT;
+            left_pane.redraw = 1; // The preview moves to the other pane
+            right_pane.redraw = 1;
             break;
 
         case KEY_UPWARD:
@@ -1662,7 +7152,7 @@ void take_action(int key, pane *pane)
             print_line(status_bar, 1, "Delete?  Press ");
             wprintw(status_bar, "%c  ", KEY_DEL_CONF);
             wattroff(status_bar, COLOR_PAIR(2));
-            confirm_key = wgetch(status_bar);
+            confirm_key = read_key(status_bar);
             if (confirm_key == KEY_DEL_CONF)
                 remove_files(pane);
             break;
@@ -1672,7 +7162,7 @@ void take_action(int key, pane *pane)
             print_line(status_bar, 1, "Yank?  Press ");
             wprintw(status_bar, "%c  ", KEY_CPY);
             wattroff(status_bar, COLOR_PAIR(2));
-            confirm_key = wgetch(status_bar);
+            confirm_key = read_key(status_bar);
             if (confirm_key == KEY_CPY)
                 yank_files(pane);
             break;
@@ -1682,7 +7172,7 @@ void take_action(int key, pane *pane)
             print_line(status_bar, 1, "Move?  Press ");
             wprintw(status_bar, "%c  ", KEY_MV);
             wattroff(status_bar, COLOR_PAIR(2));
-            confirm_key = wgetch(status_bar);
+            confirm_key = read_key(status_bar);
             if (confirm_key == KEY_MV)
                 move_files(pane);
             break;
@@ -1695,7 +7185,7 @@ void take_action(int key, pane *pane)
             break;
 
         case KEY_TOP:
-            confirm_key = wgetch(status_bar);
+            confirm_key = read_key(status_bar);
             if (confirm_key == KEY_TOP)
             {
                 pane->top_index = 0;
@@ -1766,8 +7256,7 @@ void take_action(int key, pane *pane)
             break;
 
         case KEY_SELEMPTY:
-            remove(clipboard_path);
-            clipboard_num = 0;
+            clear_clipboard();
             break;
 
         case KEY_MAKEDIR:
@@ -1785,14 +7274,16 @@ void take_action(int key, pane *pane)
             break;
 
         case KEY_VIEW:
-            preview_select(pane);
+            preview_mode = (preview_mode == 1) ? 0 : 1;
+            left_pane.redraw = 1;
+            right_pane.redraw = 1;
             break;
 
         case KEY_ADDBKMR:
             wattron(status_bar, COLOR_PAIR(2));
             print_line(status_bar, 1, "Enter the key to add a new bookmark... ");
             wattroff(status_bar, COLOR_PAIR(2));
-            confirm_key = wgetch(status_bar);
+            confirm_key = read_key(status_bar);
             if (confirm_key != ERR && isalnum(confirm_key) != 0)
             {
                 if (exist_bookmark(confirm_key) != 0)
@@ -1811,9 +7302,9 @@ void take_action(int key, pane *pane)
             else
             {
                 print_bookmarks();
-                confirm_key = wgetch(bookmarks);
+                confirm_key = read_key(bookmarks);
                 open_bookmark(confirm_key, pane);
-                delwin(bookmarks);
+                close_window(bookmarks);
             }
             break;
 
@@ -1828,48 +7319,90 @@ void take_action(int key, pane *pane)
             else
             {
                 print_bookmarks();
-                confirm_key = wgetch(bookmarks);
+                confirm_key = read_key(bookmarks);
                 remove_bookmark(confirm_key);
-                delwin(bookmarks);
+                close_window(bookmarks);
             }
             break;
 
         case KEY_SEARCH:
+            search_as_you_type(pane);
+            break;
+
+        case KEY_FUZZY:
+            find_files(pane);
+            break;
+
+        case KEY_SORT:
             wattron(status_bar, COLOR_PAIR(2));
-            print_line(status_bar, 1, "Search: ");
+            print_line(status_bar, 1, "Sort by name (a), numbers (n), size (s), time (t), extension (e) or directories first (d)? ");
             wattroff(status_bar, COLOR_PAIR(2));
-            free(search_substr);
-            search_substr = malloc(NAME_MAX);
-            if (search_substr == NULL)
-            {
-                endwin();
-                perror("memory allocation error\n");
-                exit(EXIT_FAILURE);
-            }
-            echo();
-            curs_set(1);
-            wgetnstr(status_bar, search_substr, NAME_MAX);
-            noecho();
-            curs_set(0);
-            if (strlen(search_substr) != 0 && is_empty_str(search_substr) != 0)
-            {
-                search_dir_index = search_dir(pane, search_substr, 0);
-                search_file_index = -1;
-                if (search_dir_index == -1)
-                    search_file_index = search_file(pane, search_substr, 0);
-            }
+            wrefresh(status_bar);
+            confirm_key = read_key(status_bar);
+            if (confirm_key == KEY_SORT_ALPHA)
+                sort_mode = SORT_ALPHA;
+            else if (confirm_key == KEY_SORT_NATURAL)
+                sort_mode = SORT_NATURAL;
+            else if (confirm_key == KEY_SORT_SIZE)
+                sort_mode = SORT_SIZE;
+            else if (confirm_key == KEY_SORT_TIME)
+                sort_mode = SORT_MTIME;
+            else if (confirm_key == KEY_SORT_EXT)
+                sort_mode = SORT_EXT;
+            else if (confirm_key == KEY_SORT_DIRS)
+                dirs_first = (dirs_first == 1) ? 0 : 1;
             else
-                print_notification("Please enter the correct name!");
+                break;
+            left_pane.list_dirty = 1; // The keys are made again
+            right_pane.list_dirty = 1;
             break;
 
-        case KEY_SEARCHNEXT:
-            if (search_substr != NULL)
+        case KEY_DETAILS:
+            details = (details == 1) ? 0 : 1;
+            left_pane.redraw = 1;
+            right_pane.redraw = 1;
+            break;
+
+        case KEY_USAGE:
+            usage_mode = (usage_mode == 1) ? 0 : 1;
+            if (usage_mode == 0)
+                stop_usage(); // The totals found so far are kept
+            left_pane.list_dirty = 1; // The sizes are read again
+            right_pane.list_dirty = 1;
+            break;
+
+        case KEY_COLORS:
+            mime_colors = (mime_colors == 1) ? 0 : 1;
+            if (mime_colors == 1)
+                clear_meta(); // The types are read with the details again
+            left_pane.redraw = 1;
+            right_pane.redraw = 1;
+            break;
+
+        case KEY_JOBS:
+            if (jobs == NULL)
+                print_notification("No jobs are running.");
+            else
+                manage_jobs();
+            break;
+
+        case KEY_STATS:
+            if (stats_mode == 1 && stats_win != NULL)
             {
-                if (search_file_index == -1)
-                    search_dir_index = search_dir(pane, search_substr, search_dir_index + 1);
-                if (search_dir_index == -1)
-                    search_file_index = search_file(pane, search_substr, search_file_index + 1);
+                close_window(stats_win);
+                stats_win = NULL;
             }
+            __atomic_store_n(&stats_mode, !stats_mode, __ATOMIC_RELAXED); // Read by the workers
+            memset(&last_stats, 0, sizeof(stats));
+            stats_shown = 1;
+            break;
+
+        case KEY_SEARCHNEXT:
+            go_to_match(pane, 1);
+            break;
+
+        case KEY_SEARCHPREV:
+            go_to_match(pane, 0);
             break;
     }
 }
@@ -0,0 +1,237 @@
+/* ----- NebulaFM tests ----- */
+/* See LICENSE for license details. */
+
+/* Runs nebulafm on a pseudo-terminal, changes the files of the directory it shows
+ * and checks the file it selects afterwards in the clipboard journal. */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <pty.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define QUIET_MS 300 // The events have been applied when the terminal is quiet this long
+#define TIMEOUT_MS 10000 // A session that does not start is given up
+#define TERM_ROWS 40
+#define TERM_COLS 120
+#define STATUS_MARK "]  [*" // Printed with the status bar, the first frame is complete after it
+
+typedef struct session
+{
+    pid_t pid;
+    int fd; // The master side of the pseudo-terminal
+}
+session;
+
+int test_size_order(const char *, const char *);
+void write_file(const char *, size_t);
+void start_session(session *, const char *, const char *, const char *);
+int wait_frame(session *, int, const char *);
+void press_keys(session *, const char *);
+void stop_session(session *);
+int find_in_file(const char *, const char *);
+void remove_tree(const char *);
+
+int main(int argc, char *argv[])
+{
+    const char *bin = "./nebulafm";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:")) != -1)
+    {
+        if (opt == 'b')
+            bin = optarg;
+        else
+        {
+            fprintf(stderr, "usage: %s [-b binary]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    char bin_path[PATH_MAX];
+    if (realpath(bin, bin_path) == NULL)
+    {
+        perror("path error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int failed = 0;
+    failed += test_size_order(bin_path, "a file written after it is created moves by its size");
+    printf("%s\n", (failed == 0) ? "All tests passed" : "Some tests failed");
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int test_size_order(const char *bin, const char *name)
+{
+    /* Sorted by size, an empty file written with 1 MB goes above the others */
+    char root[] = "/tmp/nebulafm-test.XXXXXX";
+    if (mkdtemp(root) == NULL)
+    {
+        perror("test error\n");
+        exit(EXIT_FAILURE);
+    }
+    char dir[PATH_MAX];
+    char conf[PATH_MAX];
+    char path[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/files", root);
+    snprintf(conf, sizeof(conf), "%s/conf", root);
+    mkdir(dir, 0755);
+    mkdir(conf, 0755);
+    snprintf(path, sizeof(path), "%s/small", dir);
+    write_file(path, 100000);
+    snprintf(path, sizeof(path), "%s/large", dir);
+    write_file(path, 200000);
+
+    session s;
+    start_session(&s, bin, dir, conf);
+    int ok = wait_frame(&s, TIMEOUT_MS, STATUS_MARK);
+    press_keys(&s, "os"); // Sort by size
+    snprintf(path, sizeof(path), "%s/new", dir);
+    write_file(path, 0);
+    wait_frame(&s, 0, NULL);
+    write_file(path, 1000000);
+    wait_frame(&s, 0, NULL);
+    press_keys(&s, "gg "); // The first file is selected
+
+    /* Read before the end of the session, the clipboard is emptied on exit */
+    char journal[PATH_MAX];
+    snprintf(journal, sizeof(journal), "%s/nebulafm/clipboard.journal", conf);
+    ok = ok == 1 && find_in_file(journal, path) == 1;
+    stop_session(&s);
+    printf("%s: %s\n", (ok == 1) ? "ok  " : "FAIL", name);
+    remove_tree(root);
+    return ok == 0;
+}
+
+void write_file(const char *path, size_t size)
+{
+    char buf[4096] = { 0 };
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        perror("test error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t done = 0; done < size; )
+    {
+        size_t len = (size - done < sizeof(buf)) ? size - done : sizeof(buf);
+        ssize_t ret = write(fd, buf, len);
+        if (ret <= 0)
+        {
+            perror("test error\n");
+            exit(EXIT_FAILURE);
+        }
+        done += ret;
+    }
+    close(fd);
+}
+
+void start_session(session *s, const char *bin, const char *dir, const char *conf)
+{
+    struct winsize ws = { .ws_row = TERM_ROWS, .ws_col = TERM_COLS };
+    s->pid = forkpty(&s->fd, NULL, NULL, &ws);
+    if (s->pid == -1)
+    {
+        perror("pty error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (s->pid == 0)
+    {
+        /* The clipboard of the user is not touched */
+        setenv("TERM", "xterm-256color", 1);
+        setenv("XDG_CONFIG_HOME", conf, 1);
+        execl(bin, bin, dir, (char *) NULL);
+        _exit(127);
+    }
+}
+
+int wait_frame(session *s, int timeout, const char *mark)
+{
+    /* 1 when the mark has come, or without a mark, when the terminal is quiet */
+    char buf[65536 + 16];
+    size_t mark_len = (mark != NULL) ? strlen(mark) : 0;
+    size_t kept = 0; // The end of the last read, the mark may be split between two reads
+    int waited = 0;
+    struct pollfd fds = { s->fd, POLLIN, 0 };
+    for (;;)
+    {
+        int ret = poll(&fds, 1, QUIET_MS);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+        {
+            if (mark == NULL)
+                return 1;
+            if ((waited += QUIET_MS) > timeout)
+                return 0;
+            continue;
+        }
+        ssize_t len = read(s->fd, buf + kept, 65536);
+        if (len <= 0)
+            return 0; // nebulafm has exited
+        if (mark != NULL && memmem(buf, kept + len, mark, mark_len) != NULL)
+            mark = NULL; // Then only the end of the frame is waited for
+        else if (mark != NULL)
+        {
+            size_t total = kept + len;
+            kept = (total < mark_len - 1) ? total : mark_len - 1;
+            memmove(buf, buf + total - kept, kept);
+        }
+    }
+}
+
+void press_keys(session *s, const char *keys)
+{
+    for (; *keys != '\0'; keys++)
+    {
+        if (write(s->fd, keys, 1) != 1)
+        {
+            perror("pty error\n");
+            exit(EXIT_FAILURE);
+        }
+        wait_frame(s, 0, NULL);
+    }
+}
+
+void stop_session(session *s)
+{
+    char key = 'q';
+    if (write(s->fd, &key, 1) != 1)
+        kill(s->pid, SIGTERM);
+    char buf[65536];
+    while (read(s->fd, buf, sizeof(buf)) > 0)
+        ; // Until the terminal is closed
+    close(s->fd);
+    waitpid(s->pid, NULL, 0);
+}
+
+int find_in_file(const char *path, const char *text)
+{
+    /* The journal keeps the paths of the selected files as they are */
+    char buf[65536];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    ssize_t len = read(fd, buf, sizeof(buf));
+    close(fd);
+    return len > 0 && memmem(buf, len, text, strlen(text)) != NULL;
+}
+
+void remove_tree(const char *root)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        execlp("rm", "rm", "-rf", root, (char *) NULL);
+        _exit(127);
+    }
+    if (pid != -1)
+        waitpid(pid, NULL, 0);
+}